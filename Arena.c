@@ -0,0 +1,104 @@
+/**
+ * Arena.c -- bump allocator for storage that lives one frame
+ *
+ * Function definitions in Arena.h
+ **/
+
+#include "Arena.h"
+
+#include <stdlib.h>
+
+struct ArenaChunk {
+  ArenaChunk* next;
+  size_t size;
+
+  // Bytes handed out; may run past size when allocations race at the end.
+  size_t used;
+
+  char data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+static ArenaChunk* newChunk(size_t size, ArenaChunk* next) {
+  ArenaChunk* chunk = malloc(sizeof(ArenaChunk) + size);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  chunk->next = next;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+Arena* Arena_new(size_t initialSize) {
+  Arena* arena = malloc(sizeof(Arena));
+  if (arena == NULL) {
+    return NULL;
+  }
+  arena->current = newChunk(initialSize, NULL);
+  if (arena->current == NULL) {
+    free(arena);
+    return NULL;
+  }
+  arena->lock = 0;
+  return arena;
+}
+
+static void freeChunks(ArenaChunk* chunk) {
+  while (chunk != NULL) {
+    ArenaChunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+}
+
+void Arena_delete(Arena* arena) {
+  freeChunks(arena->current);
+  free(arena);
+}
+
+///////////////////////////////////////////////////////////
+// Bump the current chunk.  A worker that finds it full chains in a chunk
+// twice as large, unless another worker already has, and tries again.
+// Out of memory it aborts like Arena_reset, so no caller loses storage
+// without a trace.
+void* Arena_alloc(Arena* arena, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+  while (1) {
+    ArenaChunk* chunk = __atomic_load_n(&arena->current, __ATOMIC_ACQUIRE);
+    size_t offset = __atomic_fetch_add(&chunk->used, size, __ATOMIC_RELAXED);
+    if (offset + size <= chunk->size) {
+      return chunk->data + offset;
+    }
+
+    while (__sync_lock_test_and_set(&arena->lock, 1)) {
+      // spin; chaining a chunk is a single malloc
+    }
+    if (arena->current == chunk) {
+      size_t newSize = 2 * chunk->size > size ? 2 * chunk->size : size;
+      ArenaChunk* grown = newChunk(newSize, chunk);
+      if (grown == NULL) {
+        abort();
+      }
+      __atomic_store_n(&arena->current, grown, __ATOMIC_RELEASE);
+    }
+    __sync_lock_release(&arena->lock);
+  }
+}
+
+void Arena_reset(Arena* arena) {
+  ArenaChunk* chunk = arena->current;
+  if (chunk->next == NULL) {
+    chunk->used = 0;
+    return;
+  }
+
+  size_t total = 0;
+  for (ArenaChunk* c = chunk; c != NULL; c = c->next) {
+    total += c->size;
+  }
+  freeChunks(chunk);
+  arena->current = newChunk(total, NULL);
+  if (arena->current == NULL) {
+    abort();
+  }
+}
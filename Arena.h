@@ -0,0 +1,41 @@
+/**
+ * Arena.h -- bump allocator for storage that lives one frame
+ *
+ * Allocation bumps an offset in the current chunk, and is safe from any
+ * number of workers at once.  When the chunk runs out a larger one is
+ * chained in front of it.  Nothing is freed individually: Arena_reset
+ * releases everything at once, and folds the chunks into one big enough
+ * for the whole of the last frame, so a steady scene settles on a single
+ * chunk and never allocates again.
+ **/
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+// Allocations are aligned to this many bytes.
+#define ARENA_ALIGNMENT 16
+
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct Arena {
+  // The chunk allocations are taken from; older chunks follow it.
+  ArenaChunk* current;
+
+  // Guards chaining in a new chunk.
+  int lock;
+} Arena;
+
+// Creates an arena with one chunk of initialSize bytes.
+Arena* Arena_new(size_t initialSize);
+
+void Arena_delete(Arena* arena);
+
+// Returns size bytes.  Aborts if memory runs out.
+void* Arena_alloc(Arena* arena, size_t size);
+
+// Releases every allocation.  Call only when no worker is allocating.
+void Arena_reset(Arena* arena);
+
+#endif  // ARENA_H_
@@ -0,0 +1,124 @@
+/**
+ * Autotune.c -- pick the quadtree shape and grain size on the running scene
+ *
+ * Function definitions in Autotune.h
+ **/
+
+#include "Autotune.h"
+
+#include <float.h>
+#include <stdlib.h>
+
+#include "Parallel.h"
+#include "Quadtree.h"
+
+static void applyConfig(CollisionWorld* collisionWorld,
+                        const AutotuneConfig* config) {
+  if (config->depth != collisionWorld->quadtreeDepth
+      || config->linear != collisionWorld->linearQuadtree) {
+    CollisionWorld_setQuadtree(collisionWorld, config->depth, config->linear);
+  }
+  collisionWorld->grainSize = config->grainSize;
+}
+
+static void startRound(Autotuner* autotuner, CollisionWorld* collisionWorld) {
+  for (unsigned int i = 0; i < autotuner->numCandidates; i++) {
+    autotuner->seconds[i] = DBL_MAX;
+  }
+  autotuner->trial = 0;
+  autotuner->trialFrame = 0;
+  applyConfig(collisionWorld, &autotuner->candidates[0]);
+}
+
+///////////////////////////////////////////////////////////
+// Every leaf depth and way of filling the leaves, each with the runtime's
+// grain size, a small one, and one range of lines per worker.
+Autotuner* Autotuner_new(CollisionWorld* collisionWorld, FILE* log) {
+  Autotuner* autotuner = malloc(sizeof(Autotuner));
+  if (autotuner == NULL) {
+    return NULL;
+  }
+  const unsigned int perWorker =
+      (collisionWorld->numOfLines + Parallel_numWorkers() - 1)
+      / Parallel_numWorkers();
+  const unsigned int grainSizes[] = { 0, 256, perWorker };
+
+  autotuner->numCandidates = 0;
+  for (unsigned int depth = 1; depth <= QUADTREE_MAX_DEPTH; depth++) {
+    for (int linear = 0; linear < 2; linear++) {
+      for (int g = 0; g < sizeof(grainSizes) / sizeof(grainSizes[0]); g++) {
+        if (g == 2 && grainSizes[2] <= grainSizes[1]) {
+          continue;
+        }
+        AutotuneConfig* config =
+            &autotuner->candidates[autotuner->numCandidates++];
+        config->depth = depth;
+        config->linear = linear;
+        config->grainSize = grainSizes[g];
+      }
+    }
+  }
+  autotuner->lockedPairs = -1;
+  autotuner->log = log;
+  startRound(autotuner, collisionWorld);
+  return autotuner;
+}
+
+void Autotuner_delete(Autotuner* autotuner) {
+  free(autotuner);
+}
+
+///////////////////////////////////////////////////////////
+// Time the trials one after another and lock in the fastest.  After that,
+// start over whenever the pairs in the leaves move too far.
+void Autotuner_recordFrame(Autotuner* autotuner, CollisionWorld* collisionWorld,
+                           double seconds, unsigned int frame) {
+  if (autotuner->trial < autotuner->numCandidates) {
+    double* best = &autotuner->seconds[autotuner->trial];
+    if (autotuner->trialFrame > 0 && seconds < *best) {
+      *best = seconds;
+    }
+    if (++autotuner->trialFrame < AUTOTUNE_TRIAL_FRAMES) {
+      return;
+    }
+    autotuner->trialFrame = 0;
+    if (++autotuner->trial < autotuner->numCandidates) {
+      applyConfig(collisionWorld, &autotuner->candidates[autotuner->trial]);
+      return;
+    }
+
+    unsigned int fastest = 0;
+    for (unsigned int i = 1; i < autotuner->numCandidates; i++) {
+      if (autotuner->seconds[i] < autotuner->seconds[fastest]) {
+        fastest = i;
+      }
+    }
+    AutotuneConfig* config = &autotuner->candidates[fastest];
+    applyConfig(collisionWorld, config);
+    autotuner->lockedPairs = -1;
+    if (autotuner->log != NULL) {
+      fprintf(autotuner->log,
+              "autotune: frame %u: depth %u, %s leaves, grain size %u "
+              "(%.3f ms/frame)\n", frame, config->depth,
+              config->linear ? "linear" : "scanned", config->grainSize,
+              1e3 * autotuner->seconds[fastest]);
+    }
+    return;
+  }
+
+  // one is added so empty leaves do not count as an infinite change
+  double pairs = Quadtree_numLeafPairs(collisionWorld->quadtree) + 1;
+  if (autotuner->lockedPairs < 0) {
+    autotuner->lockedPairs = pairs;
+    return;
+  }
+  if (pairs > AUTOTUNE_RETUNE_RATIO * autotuner->lockedPairs
+      || AUTOTUNE_RETUNE_RATIO * pairs < autotuner->lockedPairs) {
+    if (autotuner->log != NULL) {
+      fprintf(autotuner->log,
+              "autotune: frame %u: leaf pairs went from %.0f to %.0f, "
+              "tuning again\n", frame, autotuner->lockedPairs - 1, pairs - 1);
+    }
+    startRound(autotuner, collisionWorld);
+  }
+}
@@ -0,0 +1,71 @@
+/**
+ * Autotune.h -- pick the quadtree shape and grain size on the running scene
+ *
+ * The fastest leaf depth, way of filling the leaves and grain size depend on
+ * how many lines the scene has and how they crowd together, so one set of
+ * compile-time constants cannot suit every input.  The autotuner runs each
+ * candidate configuration for a few frames of the actual simulation, keeps
+ * the fastest and logs it.  Every configuration finds the same collisions,
+ * so tuning does not change the results.
+ *
+ * Once a configuration is locked in, the number of line pairs in the leaves
+ * is watched.  If it drifts by more than a factor of AUTOTUNE_RETUNE_RATIO
+ * from its value when the configuration was picked, the scene has spread
+ * out or crowded together, and the candidates are tried again.
+ **/
+
+#ifndef AUTOTUNE_H_
+#define AUTOTUNE_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "CollisionWorld.h"
+
+// Frames each candidate runs; the first, which rebuilds the quadtree, is
+// not timed
+#define AUTOTUNE_TRIAL_FRAMES 6
+
+// Change in leaf pairs that starts a new round of trials
+#define AUTOTUNE_RETUNE_RATIO 2.0
+
+#define AUTOTUNE_MAX_CANDIDATES 32
+
+typedef struct AutotuneConfig {
+  unsigned int depth;
+  bool linear;
+
+  // Lines per task, 0 for the runtime's default
+  unsigned int grainSize;
+} AutotuneConfig;
+
+typedef struct Autotuner {
+  AutotuneConfig candidates[AUTOTUNE_MAX_CANDIDATES];
+  unsigned int numCandidates;
+
+  // The candidate being timed, or numCandidates once one is locked in
+  unsigned int trial;
+  unsigned int trialFrame;
+
+  // Fastest frame of each candidate in the current round
+  double seconds[AUTOTUNE_MAX_CANDIDATES];
+
+  // Leaf pairs in the first frame with the locked-in configuration, or a
+  // negative number until that frame has run
+  double lockedPairs;
+
+  // Where the picks are logged, or NULL
+  FILE* log;
+} Autotuner;
+
+// Starts the first round of trials with the next frame.
+Autotuner* Autotuner_new(CollisionWorld* collisionWorld, FILE* log);
+
+void Autotuner_delete(Autotuner* autotuner);
+
+// Accounts for a frame that took the given time, and sets up the
+// configuration the next frame runs with.
+void Autotuner_recordFrame(Autotuner* autotuner, CollisionWorld* collisionWorld,
+                           double seconds, unsigned int frame);
+
+#endif  // AUTOTUNE_H_
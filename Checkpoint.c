@@ -0,0 +1,184 @@
+/**
+ * Checkpoint.c -- save and restore CollisionWorld snapshots
+ *
+ * Function definitions in Checkpoint.h
+ **/
+
+#include "Checkpoint.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "CollisionWorld.h"
+#include "Line.h"
+
+// On-disk layout: one header followed by numOfLines line records.
+typedef struct CheckpointHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t numOfLines;
+  uint32_t frame;
+  uint32_t numLineWallCollisions;
+  uint32_t numLineLineCollisions;
+  double timeStep;
+} CheckpointHeader;
+
+typedef struct CheckpointLine {
+  Vec p1;
+  Vec p2;
+  Vec velocity;
+  uint32_t id;
+  uint32_t color;
+} CheckpointLine;
+
+// A snapshot handed off to the writer thread, which owns and frees it.
+typedef struct CheckpointJob {
+  char* path;
+  size_t size;
+  char data[];
+} CheckpointJob;
+
+Checkpoint* Checkpoint_new(const char* path, const unsigned int interval) {
+  assert(path != NULL);
+
+  Checkpoint* checkpoint = malloc(sizeof(Checkpoint));
+  if (checkpoint == NULL) {
+    return NULL;
+  }
+  checkpoint->path = path;
+  checkpoint->interval = interval;
+  checkpoint->writerActive = false;
+  return checkpoint;
+}
+
+void Checkpoint_delete(Checkpoint* checkpoint) {
+  Checkpoint_wait(checkpoint);
+  free(checkpoint);
+}
+
+void Checkpoint_wait(Checkpoint* checkpoint) {
+  if (checkpoint->writerActive) {
+    pthread_join(checkpoint->writer, NULL);
+    checkpoint->writerActive = false;
+  }
+}
+
+///////////////////////////////////////////////////////////
+// Write the snapshot to a temporary file and rename it into place, so a
+// crash mid-write never leaves a truncated snapshot behind.
+static void* writeSnapshot(void* arg) {
+  CheckpointJob* job = (CheckpointJob*) arg;
+  size_t pathLength = strlen(job->path);
+  char* tmpPath = malloc(pathLength + 5);
+  memcpy(tmpPath, job->path, pathLength);
+  memcpy(tmpPath + pathLength, ".tmp", 5);
+
+  FILE* fout = fopen(tmpPath, "wb");
+  if (fout == NULL) {
+    perror("Checkpoint: fopen");
+  } else if (fwrite(job->data, 1, job->size, fout) != job->size) {
+    perror("Checkpoint: fwrite");
+    fclose(fout);
+  } else if (fclose(fout) != 0 || rename(tmpPath, job->path) != 0) {
+    perror("Checkpoint: rename");
+  }
+  free(tmpPath);
+  free(job);
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////
+// Copy the world into a compact buffer on the simulation thread (cheap),
+// then leave the file I/O to a background thread.
+void Checkpoint_save(Checkpoint* checkpoint, CollisionWorld* collisionWorld,
+                     const unsigned int frame) {
+  unsigned int numOfLines = collisionWorld->numOfLines;
+  size_t size = sizeof(CheckpointHeader) + numOfLines * sizeof(CheckpointLine);
+
+  Checkpoint_wait(checkpoint);
+
+  CheckpointJob* job = malloc(sizeof(CheckpointJob) + size);
+  if (job == NULL) {
+    return;
+  }
+  job->path = (char*) checkpoint->path;
+  job->size = size;
+
+  CheckpointHeader* header = (CheckpointHeader*) job->data;
+  header->magic = CHECKPOINT_MAGIC;
+  header->version = CHECKPOINT_VERSION;
+  header->numOfLines = numOfLines;
+  header->frame = frame;
+  header->numLineWallCollisions = collisionWorld->numLineWallCollisions;
+  header->numLineLineCollisions = collisionWorld->numLineLineCollisions;
+  header->timeStep = collisionWorld->timeStep;
+
+  CheckpointLine* records = (CheckpointLine*) (header + 1);
+  for (int i = 0; i < numOfLines; i++) {
+    Line* line = collisionWorld->lines[i];
+    records[i].p1 = line->p1;
+    records[i].p2 = line->p2;
+    records[i].velocity = line->velocity;
+    records[i].id = line->id;
+    records[i].color = line->color;
+  }
+
+  if (pthread_create(&checkpoint->writer, NULL, writeSnapshot, job) != 0) {
+    // Fall back to writing synchronously.
+    writeSnapshot(job);
+    return;
+  }
+  checkpoint->writerActive = true;
+}
+
+CollisionWorld* Checkpoint_restore(const char* path, unsigned int* frame) {
+  FILE* fin = fopen(path, "rb");
+  if (fin == NULL) {
+    perror("Checkpoint: fopen");
+    return NULL;
+  }
+
+  CheckpointHeader header;
+  if (fread(&header, sizeof(header), 1, fin) != 1
+      || header.magic != CHECKPOINT_MAGIC
+      || header.version != CHECKPOINT_VERSION
+      || header.numOfLines == 0) {
+    fprintf(stderr, "Checkpoint: %s is not a valid snapshot\n", path);
+    fclose(fin);
+    return NULL;
+  }
+
+  CheckpointLine* records = malloc(header.numOfLines * sizeof(CheckpointLine));
+  if (records == NULL
+      || fread(records, sizeof(CheckpointLine), header.numOfLines, fin)
+         != header.numOfLines) {
+    fprintf(stderr, "Checkpoint: %s is truncated\n", path);
+    free(records);
+    fclose(fin);
+    return NULL;
+  }
+  fclose(fin);
+
+  CollisionWorld* collisionWorld = CollisionWorld_new(header.numOfLines);
+  collisionWorld->timeStep = header.timeStep;
+  for (int i = 0; i < header.numOfLines; i++) {
+    Line* line = malloc(sizeof(Line));
+    line->p1 = records[i].p1;
+    line->p2 = records[i].p2;
+    line->velocity = records[i].velocity;
+    line->id = records[i].id;
+    line->color = (Color) records[i].color;
+
+    // transfer ownership of line to collisionWorld
+    CollisionWorld_addLine(collisionWorld, line);
+  }
+  collisionWorld->numLineWallCollisions = header.numLineWallCollisions;
+  collisionWorld->numLineLineCollisions = header.numLineLineCollisions;
+  free(records);
+
+  *frame = header.frame;
+  return collisionWorld;
+}
@@ -0,0 +1,50 @@
+/**
+ * Checkpoint.h -- save and restore CollisionWorld snapshots
+ *
+ * A snapshot holds everything needed to continue a simulation bit-for-bit:
+ * each line's endpoints, velocity, color and ID, the collision counters and
+ * the frame number.  Derived state (lengths, parallelograms, the quadtree)
+ * is rebuilt on restore.
+ **/
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "CollisionWorld.h"
+
+#define CHECKPOINT_MAGIC 0x4b435353  // "SSCK"
+#define CHECKPOINT_VERSION 1
+
+typedef struct Checkpoint {
+  // File the snapshot is written to.
+  const char* path;
+
+  // Write a snapshot every interval frames, 0 for no periodic snapshots.
+  unsigned int interval;
+
+  // The background thread writing the last snapshot, if any.
+  pthread_t writer;
+  bool writerActive;
+} Checkpoint;
+
+Checkpoint* Checkpoint_new(const char* path, const unsigned int interval);
+
+// Waits for any in-flight write before deallocating.
+void Checkpoint_delete(Checkpoint* checkpoint);
+
+// Copies the state of the collision world and writes it out on a
+// background thread.  At most one write is in flight at a time.
+void Checkpoint_save(Checkpoint* checkpoint, CollisionWorld* collisionWorld,
+                     const unsigned int frame);
+
+// Blocks until the last snapshot has been written.
+void Checkpoint_wait(Checkpoint* checkpoint);
+
+// Rebuilds a collision world from the snapshot at path.  Returns NULL if the
+// file cannot be read or is not a snapshot.
+CollisionWorld* Checkpoint_restore(const char* path, unsigned int* frame);
+
+#endif  // CHECKPOINT_H_
@@ -27,15 +27,15 @@
 #include <math.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "IntersectionDetection.h"
 #include "IntersectionEventList.h"
 #include "Line.h"
+#include "Numa.h"
 #include "Quadtree.h"
 
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
-#include <cilk/reducer_opadd.h>
+#include "Parallel.h"
 
 ///////////////////////////////////////////////////////////////////////
 // Create a new collision world
@@ -53,17 +53,50 @@ CollisionWorld* CollisionWorld_new(const unsigned int capacity) {
   collisionWorld->timeStep = 0.5;
   collisionWorld->lines = malloc(capacity * sizeof(Line*));
   collisionWorld->numOfLines = 0;
-  collisionWorld->quadtree = Quadtree_new(collisionWorld, Vec_make(BOX_XMIN,BOX_YMIN), Vec_make(BOX_XMAX,BOX_YMAX), NULL); 
+  collisionWorld->numaPlacement = NULL;
+  collisionWorld->lineStorage = NULL;
+  collisionWorld->grainSize = 0;
+  collisionWorld->quadtreeDepth = QUADTREE_DEPTH;
+  collisionWorld->stepFrames = 1;
+  collisionWorld->candidates = IntersectionEventList_make();
+  collisionWorld->candidateFrames = 0;
+  collisionWorld->leafMasksValid = false;
+#if defined(QUADTREE_LINEAR)
+  collisionWorld->linearQuadtree = true;
+#else
+  collisionWorld->linearQuadtree = false;
+#endif
+  collisionWorld->recordEvents = false;
+  collisionWorld->events = NULL;
+  collisionWorld->numEvents = 0;
+  collisionWorld->eventCapacity = 0;
+  collisionWorld->stats = NULL;
+  collisionWorld->quadtree = Quadtree_new(collisionWorld, Vec_make(BOX_XMIN,BOX_YMIN), Vec_make(BOX_XMAX,BOX_YMAX)); 
   return collisionWorld;
 }
 
+// Drop the pairs of a failed adaptive step.
+static void forgetCandidates(CollisionWorld* collisionWorld) {
+  IntersectionEventList_deleteNodes(&collisionWorld->candidates);
+  collisionWorld->candidateFrames = 0;
+}
+
 ///////////////////////////////////////////////////////////////////////
 // Delete collision world and deallocate.
 void CollisionWorld_delete(CollisionWorld* collisionWorld) {
-  for (int i = 0; i < collisionWorld->numOfLines; i++) {
-    free(collisionWorld->lines[i]);
+  if (collisionWorld->numaPlacement != NULL) {
+    NumaPlacement_delete(collisionWorld->numaPlacement);
+  } else if (collisionWorld->lineStorage != NULL) {
+    free(collisionWorld->lineStorage);
+  } else {
+    for (int i = 0; i < collisionWorld->numOfLines; i++) {
+      free(collisionWorld->lines[i]);
+    }
   }
+  forgetCandidates(collisionWorld);
   free(collisionWorld->lines);
+  free(collisionWorld->events);
+  free(collisionWorld->stats);
   Quadtree_delete(collisionWorld->quadtree);
   free(collisionWorld);
 }
@@ -77,18 +110,40 @@ unsigned int CollisionWorld_getNumOfLines(CollisionWorld* collisionWorld) {
 ///////////////////////////////////////////////////////////////////////
 // Add a line to the collision world
 void CollisionWorld_addLine(CollisionWorld* collisionWorld, Line *line) {
-  // precalculate the length of the line
-  line->length = Vec_length(Vec_subtract(line->p1, line->p2));
-  // line->distancePerTimestep = Vec_multiply(line->velocity, collisionWorld->timeStep);
-  
-  // precalculate the parallelogram created by initial velocity
-  updateParallelogram(line, collisionWorld->timeStep);
-  
-  collisionWorld->lines[collisionWorld->numOfLines] = line;
-  collisionWorld->numOfLines++;
+  CollisionWorld_addLines(collisionWorld, &line, 1);
+}
+
+void CollisionWorld_addLines(CollisionWorld* collisionWorld, Line** lines,
+                             const unsigned int numOfLines) {
+  for (unsigned int i = 0; i < numOfLines; i++) {
+    Line* line = lines[i];
+
+    // precalculate the length of the line
+    line->length = Vec_length(Vec_subtract(line->p1, line->p2));
+    // line->distancePerTimestep = Vec_multiply(line->velocity, collisionWorld->timeStep);
+
+    // precalculate the parallelogram created by initial velocity
+    updateParallelogram(line, collisionWorld->timeStep);
+
+    collisionWorld->lines[collisionWorld->numOfLines] = line;
+    collisionWorld->numOfLines++;
+  }
+  collisionWorld->leafMasksValid = false;
   // recreate the quadtree (this setup is called before the timed portion)
   Quadtree_delete(collisionWorld->quadtree);
-  collisionWorld->quadtree = Quadtree_new(collisionWorld, Vec_make(BOX_XMIN,BOX_YMIN), Vec_make(BOX_XMAX,BOX_YMAX), NULL);
+  collisionWorld->quadtree = Quadtree_new(collisionWorld, Vec_make(BOX_XMIN,BOX_YMIN), Vec_make(BOX_XMAX,BOX_YMAX));
+}
+
+///////////////////////////////////////////////////////////////////////
+// Replace the quadtree with one of the given shape
+void CollisionWorld_setQuadtree(CollisionWorld* collisionWorld,
+                                unsigned int depth, bool linear) {
+  assert(depth <= QUADTREE_MAX_DEPTH);
+  collisionWorld->quadtreeDepth = depth;
+  collisionWorld->linearQuadtree = linear;
+  collisionWorld->leafMasksValid = false;
+  Quadtree_delete(collisionWorld->quadtree);
+  collisionWorld->quadtree = Quadtree_new(collisionWorld, Vec_make(BOX_XMIN,BOX_YMIN), Vec_make(BOX_XMAX,BOX_YMAX));
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -102,76 +157,164 @@ Line* CollisionWorld_getLine(CollisionWorld* collisionWorld,
 }
 
 ///////////////////////////////////////////////////////////////////////
-// Update the lines in the collision world
-void CollisionWorld_updateLines(CollisionWorld* collisionWorld) {
-  CILK_C_REDUCER_OPADD(numCollisionsReducer, int, 0);
-  CILK_C_REGISTER_REDUCER(numCollisionsReducer);
-  CollisionWorld_detectIntersection(collisionWorld, &numCollisionsReducer);
-  CollisionWorld_updatePosition(collisionWorld);
-  CollisionWorld_lineWallCollision(collisionWorld, &numCollisionsReducer);
-  CILK_C_UNREGISTER_REDUCER(numCollisionsReducer);
+// Change the time step of the collision world
+void CollisionWorld_setTimeStep(CollisionWorld* collisionWorld,
+                                const double timeStep) {
+  collisionWorld->timeStep = timeStep;
+  collisionWorld->leafMasksValid = false;
+  forgetCandidates(collisionWorld);
+  for (int i = 0; i < collisionWorld->numOfLines; i++) {
+    updateParallelogram(collisionWorld->lines[i], timeStep);
+  }
 }
 
 ///////////////////////////////////////////////////////////////////////
-// Update the positions of all of the lines in the collision world
-void CollisionWorld_updatePosition(CollisionWorld* collisionWorld) {
-  double t = collisionWorld->timeStep;
-  cilk_for (int i = 0; i < collisionWorld->numOfLines; i++) {
-    Line *line = collisionWorld->lines[i];
-    line->p1 = Vec_add(line->p1, Vec_multiply(line->velocity, t));
-    line->p2 = Vec_add(line->p2, Vec_multiply(line->velocity, t));
+// Reorder the lines.  Each line gets a 32-bit key interleaving 16 bits of
+// its midpoint's x and y; lines with equal keys keep their order.
+
+typedef struct LineKey {
+  unsigned int key;
+  unsigned int index;
+} LineKey;
+
+typedef struct KeyContext {
+  CollisionWorld* collisionWorld;
+  LineKey* keys;
+} KeyContext;
+
+// Spread the low 16 bits of x to the even bits.
+static inline unsigned int spreadBits(unsigned int x) {
+  x &= 0xffff;
+  x = (x | (x << 8)) & 0x00ff00ff;
+  x = (x | (x << 4)) & 0x0f0f0f0f;
+  x = (x | (x << 2)) & 0x33333333;
+  x = (x | (x << 1)) & 0x55555555;
+  return x;
+}
+
+// Scale a coordinate in [min, max] to 16 bits, clamping lines outside.
+static inline unsigned int quantize(double value, double min, double max) {
+  double scaled = (value - min) / (max - min) * 65535.0;
+  if (!(scaled > 0)) {
+    return 0;
   }
+  return scaled >= 65535.0 ? 65535 : (unsigned int) scaled;
 }
 
-///////////////////////////////////////////////////////////////////////
-// Calculate change in velocity when a line collides with a wall
-void CollisionWorld_lineWallCollision(CollisionWorld* collisionWorld, CILK_C_REDUCER_OPADD_TYPE(int)* numCollisionsReducer) {
-  REDUCER_VIEW(*numCollisionsReducer) = 0;
-  cilk_for (int i = 0; i < collisionWorld->numOfLines; i++) {
-    Line *line = collisionWorld->lines[i];
+static void computeKeys(void* context, int begin, int end) {
+  KeyContext* keyContext = (KeyContext*) context;
+  for (int i = begin; i < end; i++) {
+    Line* line = keyContext->collisionWorld->lines[i];
+    unsigned int x = quantize((line->p1.x + line->p2.x) / 2, BOX_XMIN, BOX_XMAX);
+    unsigned int y = quantize((line->p1.y + line->p2.y) / 2, BOX_YMIN, BOX_YMAX);
+    keyContext->keys[i].key = spreadBits(x) | (spreadBits(y) << 1);
+    keyContext->keys[i].index = i;
+  }
+}
 
-    // Right side
-    if (MAX(line->p1.x,line->p2.x) > BOX_XMAX && (line->velocity.x > 0)) {
-      line->velocity.x = -line->velocity.x;
-      REDUCER_VIEW(*numCollisionsReducer)++;
-    }
-    // Left side
-    else if (MIN(line->p1.x,line->p2.x) < BOX_XMIN && (line->velocity.x < 0)) {
-      line->velocity.x = -line->velocity.x;
-      REDUCER_VIEW(*numCollisionsReducer)++;
-    }
-    // Top side
-    else if (MAX(line->p1.y,line->p2.y) > BOX_YMAX && (line->velocity.y > 0)) {
-      line->velocity.y = -line->velocity.y;
-      REDUCER_VIEW(*numCollisionsReducer)++;
-    }
-    // Bottom side
-    else if (MIN(line->p1.y,line->p2.y) < BOX_YMIN && (line->velocity.y < 0)) {
-      line->velocity.y = -line->velocity.y;
-      REDUCER_VIEW(*numCollisionsReducer)++;
+static int compareKeys(const void* a, const void* b) {
+  const LineKey* k1 = (const LineKey*) a;
+  const LineKey* k2 = (const LineKey*) b;
+  if (k1->key != k2->key) {
+    return k1->key < k2->key ? -1 : 1;
+  }
+  return k1->index < k2->index ? -1 : (k1->index > k2->index);
+}
+
+void CollisionWorld_reorderLines(CollisionWorld* collisionWorld) {
+  const unsigned int numOfLines = collisionWorld->numOfLines;
+  if (numOfLines == 0) {
+    return;
+  }
+  KeyContext context = { collisionWorld, malloc(numOfLines * sizeof(LineKey)) };
+  Parallel_for(0, numOfLines, CollisionWorld_grainSize(collisionWorld, numOfLines),
+               computeKeys, &context);
+  qsort(context.keys, numOfLines, sizeof(LineKey), compareKeys);
+
+  Line** lines = malloc(numOfLines * sizeof(Line*));
+  for (int i = 0; i < numOfLines; i++) {
+    lines[i] = collisionWorld->lines[context.keys[i].index];
+  }
+  memcpy(collisionWorld->lines, lines, numOfLines * sizeof(Line*));
+  free(context.keys);
+
+  // the NUMA slabs are filled in line order
+  if (collisionWorld->numaPlacement != NULL) {
+    free(lines);
+    NumaPlacement_placeLines(collisionWorld->numaPlacement, collisionWorld);
+    return;
+  }
+
+  Line* storage = malloc(numOfLines * sizeof(Line));
+  for (int i = 0; i < numOfLines; i++) {
+    storage[i] = *lines[i];
+    collisionWorld->lines[i] = &storage[i];
+  }
+  if (collisionWorld->lineStorage != NULL) {
+    free(collisionWorld->lineStorage);
+  } else {
+    for (int i = 0; i < numOfLines; i++) {
+      free(lines[i]);
     }
-    
-    // precalculate the parallelogram created by final velocity
-    updateParallelogram(line, collisionWorld->timeStep);
   }
-  collisionWorld->numLineWallCollisions += REDUCER_VIEW(*numCollisionsReducer);
+  collisionWorld->lineStorage = storage;
+  free(lines);
 }
 
 ///////////////////////////////////////////////////////////////////////
-// Detect intersections between lines
-void CollisionWorld_detectIntersection(CollisionWorld* collisionWorld, CILK_C_REDUCER_OPADD_TYPE(int)* numCollisionsReducer) {
-  // Use a reducer to detect intersections
-  IntersectionEventListReducer intersectionEventListReducer = CILK_C_INIT_REDUCER(/* type */ IntersectionEventList,
-  intersection_event_list_reduce, intersection_event_list_identity, intersection_event_list_destroy,
-  /* initial value */ (IntersectionEventList) { .head = NULL, .tail = NULL });
-  CILK_C_REGISTER_REDUCER(intersectionEventListReducer);
-  Quadtree_update(collisionWorld->quadtree); 
-  detectCollisionsReducer(collisionWorld->quadtree, &intersectionEventListReducer, numCollisionsReducer);
-  int numCollisions = REDUCER_VIEW(*numCollisionsReducer);
-  IntersectionEventList intersectionEventList = REDUCER_VIEW(intersectionEventListReducer);
-  
+// Get the grain size for a parallel loop over n lines.  By default this
+// gives about 8 ranges per worker.
+int CollisionWorld_grainSize(CollisionWorld* collisionWorld,
+                             const unsigned int n) {
+  if (collisionWorld->grainSize > 0) {
+    return collisionWorld->grainSize;
+  }
+  int tasks = 8 * Parallel_numWorkers();
+  int grainSize = (n + tasks - 1) / tasks;
+  return grainSize < 1 ? 1 : MIN(grainSize, 2048);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Start keeping the events solved in each frame
+void CollisionWorld_recordEvents(CollisionWorld* collisionWorld) {
+  collisionWorld->recordEvents = true;
+}
+
+void CollisionWorld_recordStats(CollisionWorld* collisionWorld) {
+  if (collisionWorld->stats == NULL) {
+    collisionWorld->stats = calloc(1, sizeof(QuadtreeStats));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Append an event to the events solved this frame
+static void recordEvent(CollisionWorld* collisionWorld,
+                        IntersectionEventNode* node) {
+  if (collisionWorld->numEvents == collisionWorld->eventCapacity) {
+    collisionWorld->eventCapacity = collisionWorld->eventCapacity == 0 ?
+        64 : 2 * collisionWorld->eventCapacity;
+    collisionWorld->events = realloc(collisionWorld->events,
+        collisionWorld->eventCapacity * sizeof(CollisionEvent));
+    assert(collisionWorld->events != NULL);
+  }
+  CollisionEvent* event = &collisionWorld->events[collisionWorld->numEvents++];
+  event->id1 = node->l1->id;
+  event->id2 = node->l2->id;
+  event->intersectionType = node->intersectionType;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Sort the events of a frame, drop duplicates, solve them in order and
+// count them, then delete the list.  numCollisions is the number of events
+// in the list, duplicates included.
+static void solveEvents(CollisionWorld* collisionWorld,
+                        IntersectionEventList* intersectionEventList,
+                        int numCollisions) {
+  collisionWorld->numEvents = 0;
+  unsigned int numDuplicates = 0;
+
   // Sort the intersection event list.
-  IntersectionEventNode* startNode = intersectionEventList.head;
+  IntersectionEventNode* startNode = intersectionEventList->head;
   while (startNode != NULL) {
     IntersectionEventNode* minNode = startNode;
     IntersectionEventNode* curNode = startNode->next;
@@ -185,6 +328,7 @@ void CollisionWorld_detectIntersection(CollisionWorld* collisionWorld, CILK_C_RE
         prevNode->next = curNode;
         free(delNode);
         numCollisions--;
+        numDuplicates++;
       } else {
         if (comp < 0) {
           minNode = curNode;
@@ -198,12 +342,321 @@ void CollisionWorld_detectIntersection(CollisionWorld* collisionWorld, CILK_C_RE
     }
     CollisionWorld_collisionSolver(collisionWorld, startNode->l1, startNode->l2,
                                    startNode->intersectionType);
+    if (collisionWorld->recordEvents) {
+      recordEvent(collisionWorld, startNode);
+    }
     startNode = startNode->next;
   }
 
   // update the number of line-to-line collisions
   collisionWorld->numLineLineCollisions += numCollisions;
-  CILK_C_UNREGISTER_REDUCER(intersectionEventListReducer);
+  if (collisionWorld->stats != NULL) {
+    collisionWorld->stats->duplicates = numDuplicates;
+  }
+  IntersectionEventList_deleteNodes(intersectionEventList);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Update the lines in the collision world
+void CollisionWorld_updateLines(CollisionWorld* collisionWorld) {
+  forgetCandidates(collisionWorld);
+  ParallelCounter numCollisions;
+  ParallelCounter_init(&numCollisions);
+  CollisionWorld_detectIntersection(collisionWorld, &numCollisions);
+  CollisionWorld_advanceLines(collisionWorld, 1, &numCollisions);
+  ParallelCounter_destroy(&numCollisions);
+}
+
+typedef struct LineWallContext {
+  CollisionWorld* collisionWorld;
+  ParallelCounter* numCollisions;
+
+  // How many time steps advanceRange moves the lines
+  unsigned int frames;
+} LineWallContext;
+
+// Reverse the velocity of a line that is past a wall and still moving
+// away from the box.  Returns true if it bounced.
+static inline bool bounceOffWalls(Line* line) {
+  // Right side
+  if (MAX(line->p1.x,line->p2.x) > BOX_XMAX && (line->velocity.x > 0)) {
+    line->velocity.x = -line->velocity.x;
+    return true;
+  }
+  // Left side
+  if (MIN(line->p1.x,line->p2.x) < BOX_XMIN && (line->velocity.x < 0)) {
+    line->velocity.x = -line->velocity.x;
+    return true;
+  }
+  // Top side
+  if (MAX(line->p1.y,line->p2.y) > BOX_YMAX && (line->velocity.y > 0)) {
+    line->velocity.y = -line->velocity.y;
+    return true;
+  }
+  // Bottom side
+  if (MIN(line->p1.y,line->p2.y) < BOX_YMIN && (line->velocity.y < 0)) {
+    line->velocity.y = -line->velocity.y;
+    return true;
+  }
+  return false;
+}
+
+// True if the quadtree's leaves fit in a leafMask
+static inline bool leafMasksFit(CollisionWorld* collisionWorld) {
+  return collisionWorld->quadtree->leafDepth <= QUADTREE_MASK_DEPTH;
+}
+
+// Precalculate the parallelogram the line sweeps over the time step, and
+// the leaves it overlaps if findLeaves is set.
+static inline void sweepLine(CollisionWorld* collisionWorld, Line* line,
+                             bool findLeaves) {
+  updateParallelogram(line, collisionWorld->timeStep);
+  if (findLeaves) {
+    line->leafMask = Quadtree_leafMask(collisionWorld->quadtree, line);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Everything that happens to a line between two detections, done while
+// the line is in cache.
+static void advanceRange(void* context, int begin, int end) {
+  CollisionWorld* collisionWorld = ((LineWallContext*) context)->collisionWorld;
+  int* numCollisions = ParallelCounter_view(((LineWallContext*) context)->numCollisions);
+  const unsigned int frames = ((LineWallContext*) context)->frames;
+  const double t = collisionWorld->timeStep;
+  const bool findLeaves = leafMasksFit(collisionWorld);
+  for (int i = begin; i < end; i++) {
+    Line *line = collisionWorld->lines[i];
+    // frame by frame, so a step of several frames rounds like single ones
+    Vec shift = Vec_multiply(line->velocity, t);
+    for (unsigned int frame = 0; frame < frames; frame++) {
+      line->p1 = Vec_add(line->p1, shift);
+      line->p2 = Vec_add(line->p2, shift);
+    }
+    if (bounceOffWalls(line)) {
+      (*numCollisions)++;
+    }
+    sweepLine(collisionWorld, line, findLeaves);
+  }
+}
+
+void CollisionWorld_advanceLines(CollisionWorld* collisionWorld,
+                                 unsigned int frames,
+                                 ParallelCounter* numCollisions) {
+  ParallelCounter_reset(numCollisions);
+  LineWallContext context = { collisionWorld, numCollisions, frames };
+  Parallel_for(0, collisionWorld->numOfLines,
+               CollisionWorld_grainSize(collisionWorld, collisionWorld->numOfLines),
+               advanceRange, &context);
+  collisionWorld->numLineWallCollisions += ParallelCounter_sum(numCollisions);
+  collisionWorld->leafMasksValid = leafMasksFit(collisionWorld);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Take a step of several frames if nothing can collide during it.
+//
+// Over a step with no collisions every line moves in a straight line, so
+// the parallelograms swept over the whole step contain those of each frame
+// in it.  If no line's sweep leaves the box and detection over the whole
+// step finds no pair, none of the frames would have solved a collision,
+// and the step moves the lines to where the frames would have.
+//
+// The same containment makes a failed step's pairs cover each frame of
+// it, up to the first that solves a collision and so changes a velocity:
+// every pair those frames' detection would find is among them.  So those
+// frames test only these pairs, and neither rebuild the quadtree nor sweep
+// the other lines back.
+
+// Sweep the lines over the current time step, counting the sweeps that
+// leave the box.
+static void sweepRange(void* context, int begin, int end) {
+  CollisionWorld* collisionWorld = ((LineWallContext*) context)->collisionWorld;
+  int* numLeaving = ParallelCounter_view(((LineWallContext*) context)->numCollisions);
+  const bool findLeaves = leafMasksFit(collisionWorld);
+  for (int i = begin; i < end; i++) {
+    Line *line = collisionWorld->lines[i];
+    sweepLine(collisionWorld, line, findLeaves);
+    if (line->sweptMin.x < BOX_XMIN || line->sweptMax.x > BOX_XMAX
+        || line->sweptMin.y < BOX_YMIN || line->sweptMax.y > BOX_YMAX) {
+      (*numLeaving)++;
+    }
+  }
+}
+
+static unsigned int sweepLines(CollisionWorld* collisionWorld,
+                               ParallelCounter* numLeaving) {
+  LineWallContext context = { collisionWorld, numLeaving, 0 };
+  Parallel_for(0, collisionWorld->numOfLines,
+               CollisionWorld_grainSize(collisionWorld, collisionWorld->numOfLines),
+               sweepRange, &context);
+  collisionWorld->leafMasksValid = leafMasksFit(collisionWorld);
+  return ParallelCounter_sum(numLeaving);
+}
+
+// Whether nothing can collide over the current time step.  If detection
+// ran and found pairs, they are left in candidates; otherwise candidates
+// is empty.
+static bool sweepIsClear(CollisionWorld* collisionWorld,
+                         IntersectionEventList* candidates) {
+  ParallelCounter numCollisions;
+  ParallelCounter_init(&numCollisions);
+  *candidates = IntersectionEventList_make();
+  bool clear = sweepLines(collisionWorld, &numCollisions) == 0;
+  if (clear) {
+    IntersectionEventListReducer intersectionEventListReducer;
+    IntersectionEventListReducer_init(&intersectionEventListReducer);
+    Quadtree_update(collisionWorld->quadtree);
+    detectCollisionsReducer(collisionWorld->quadtree,
+                            &intersectionEventListReducer, &numCollisions);
+    clear = ParallelCounter_sum(&numCollisions) == 0;
+    *candidates = IntersectionEventListReducer_reduce(&intersectionEventListReducer);
+    IntersectionEventListReducer_destroy(&intersectionEventListReducer);
+  }
+  ParallelCounter_destroy(&numCollisions);
+  return clear;
+}
+
+// Do one frame of a failed step, testing only the pairs it found.  The
+// candidates' lines are swept over one frame again, and each pair goes
+// through fastIntersect and intersect as in the quadtree's narrowphase.
+static unsigned int updateCandidates(CollisionWorld* collisionWorld) {
+  IntersectionEventList* candidates = &collisionWorld->candidates;
+  for (IntersectionEventNode* node = candidates->head; node != NULL;
+       node = node->next) {
+    updateParallelogram(node->l1, collisionWorld->timeStep);
+    updateParallelogram(node->l2, collisionWorld->timeStep);
+  }
+  const unsigned int numBefore = collisionWorld->numLineWallCollisions
+      + collisionWorld->numLineLineCollisions;
+  IntersectionEventList intersectionEventList = IntersectionEventList_make();
+  int numCollisions = 0;
+  for (IntersectionEventNode* node = candidates->head; node != NULL;
+       node = node->next) {
+    Line* l1 = node->l1;
+    Line* l2 = node->l2;
+    Vec shift = Vec_subtract(l2->shift, l1->shift);
+    Vec p1 = Vec_add(l2->p1, shift);
+    Vec p2 = Vec_add(l2->p2, shift);
+    if (fastIntersectPoints(l1->p1, l1->p2, l2->p1, l2->p2, p1, p2)) {
+      IntersectionEventList_appendNode(&intersectionEventList, l1, l2,
+                                       intersect(l1, l2, p1, p2));
+      numCollisions++;
+    }
+  }
+  solveEvents(collisionWorld, &intersectionEventList, numCollisions);
+
+  ParallelCounter numWallCollisions;
+  ParallelCounter_init(&numWallCollisions);
+  CollisionWorld_advanceLines(collisionWorld, 1, &numWallCollisions);
+  ParallelCounter_destroy(&numWallCollisions);
+
+  // a collision ends the step's cover; frames like a single frame's follow
+  bool clear = numBefore == collisionWorld->numLineWallCollisions
+      + collisionWorld->numLineLineCollisions;
+  if (--collisionWorld->candidateFrames == 0 || !clear) {
+    forgetCandidates(collisionWorld);
+    collisionWorld->stepFrames = clear ? 2 : 1;
+  }
+  return 1;
+}
+
+unsigned int CollisionWorld_updateLinesAdaptive(CollisionWorld* collisionWorld,
+                                                unsigned int maxFrames) {
+  if (collisionWorld->candidateFrames > 0) {
+    return updateCandidates(collisionWorld);
+  }
+  const double timeStep = collisionWorld->timeStep;
+  const unsigned int frames = MIN(collisionWorld->stepFrames, maxFrames);
+  if (frames > 1) {
+    collisionWorld->timeStep = frames * timeStep;
+    bool clear = sweepIsClear(collisionWorld, &collisionWorld->candidates);
+    collisionWorld->timeStep = timeStep;
+    if (!clear && collisionWorld->candidates.head != NULL) {
+      collisionWorld->candidateFrames = frames;
+      return updateCandidates(collisionWorld);
+    }
+
+    // move the lines the whole step, or sweep them back over one frame
+    ParallelCounter numCollisions;
+    ParallelCounter_init(&numCollisions);
+    if (clear) {
+      CollisionWorld_advanceLines(collisionWorld, frames, &numCollisions);
+    } else {
+      sweepLines(collisionWorld, &numCollisions);
+    }
+    ParallelCounter_destroy(&numCollisions);
+    if (clear) {
+      collisionWorld->stepFrames = MIN(2 * collisionWorld->stepFrames,
+                                       ADAPTIVE_MAX_FRAMES);
+      return frames;
+    }
+  }
+
+  const unsigned int numCollisions = collisionWorld->numLineWallCollisions
+      + collisionWorld->numLineLineCollisions;
+  CollisionWorld_updateLines(collisionWorld);
+  bool clear = numCollisions == collisionWorld->numLineWallCollisions
+      + collisionWorld->numLineLineCollisions;
+  collisionWorld->stepFrames = clear && frames <= 1 ? 2 : 1;
+  return 1;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Update the positions of all of the lines in the collision world
+static void updatePositionRange(void* context, int begin, int end) {
+  CollisionWorld* collisionWorld = (CollisionWorld*) context;
+  double t = collisionWorld->timeStep;
+  for (int i = begin; i < end; i++) {
+    Line *line = collisionWorld->lines[i];
+    line->p1 = Vec_add(line->p1, Vec_multiply(line->velocity, t));
+    line->p2 = Vec_add(line->p2, Vec_multiply(line->velocity, t));
+  }
+}
+
+void CollisionWorld_updatePosition(CollisionWorld* collisionWorld) {
+  Parallel_for(0, collisionWorld->numOfLines,
+               CollisionWorld_grainSize(collisionWorld, collisionWorld->numOfLines),
+               updatePositionRange, collisionWorld);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Calculate change in velocity when a line collides with a wall
+static void lineWallCollisionRange(void* context, int begin, int end) {
+  CollisionWorld* collisionWorld = ((LineWallContext*) context)->collisionWorld;
+  int* numCollisions = ParallelCounter_view(((LineWallContext*) context)->numCollisions);
+  for (int i = begin; i < end; i++) {
+    Line *line = collisionWorld->lines[i];
+    if (bounceOffWalls(line)) {
+      (*numCollisions)++;
+    }
+
+    // precalculate the parallelogram created by final velocity
+    sweepLine(collisionWorld, line, false);
+  }
+}
+
+void CollisionWorld_lineWallCollision(CollisionWorld* collisionWorld, ParallelCounter* numCollisions) {
+  ParallelCounter_reset(numCollisions);
+  LineWallContext context = { collisionWorld, numCollisions, 0 };
+  Parallel_for(0, collisionWorld->numOfLines,
+               CollisionWorld_grainSize(collisionWorld, collisionWorld->numOfLines),
+               lineWallCollisionRange, &context);
+  collisionWorld->numLineWallCollisions += ParallelCounter_sum(numCollisions);
+  collisionWorld->leafMasksValid = false;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Detect intersections between lines
+void CollisionWorld_detectIntersection(CollisionWorld* collisionWorld, ParallelCounter* numCollisionsCounter) {
+  // Use a reducer to detect intersections
+  IntersectionEventListReducer intersectionEventListReducer;
+  IntersectionEventListReducer_init(&intersectionEventListReducer);
+  Quadtree_update(collisionWorld->quadtree); 
+  detectCollisionsReducer(collisionWorld->quadtree, &intersectionEventListReducer, numCollisionsCounter);
+  int numCollisions = ParallelCounter_sum(numCollisionsCounter);
+  IntersectionEventList intersectionEventList = IntersectionEventListReducer_reduce(&intersectionEventListReducer);
+  solveEvents(collisionWorld, &intersectionEventList, numCollisions);
+  IntersectionEventListReducer_destroy(&intersectionEventListReducer);
 }
 
 unsigned int CollisionWorld_getNumLineWallCollisions(
@@ -216,6 +669,18 @@ unsigned int CollisionWorld_getNumLineLineCollisions(
   return collisionWorld->numLineLineCollisions;
 }
 
+///////////////////////////////////////////////////////////////////////
+// The line's velocity turned to point from p toward its farther endpoint,
+// keeping its speed.  Distances are compared squared, and the new velocity
+// is that endpoint's offset scaled by a single square root.
+static inline Vec awayFromPoint(Line* line, Vec p) {
+  Vec d1 = Vec_subtract(line->p1, p);
+  Vec d2 = Vec_subtract(line->p2, p);
+  Vec away = Vec_dotProduct(d1, d1) < Vec_dotProduct(d2, d2) ? d2 : d1;
+  double speedSquared = Vec_dotProduct(line->velocity, line->velocity);
+  return Vec_multiply(away, sqrt(speedSquared / Vec_dotProduct(away, away)));
+}
+
 void CollisionWorld_collisionSolver(CollisionWorld* collisionWorld,
                                     Line *l1, Line *l2,
                                     IntersectionType intersectionType) {
@@ -232,25 +697,8 @@ void CollisionWorld_collisionSolver(CollisionWorld* collisionWorld,
   // energy.
   if (intersectionType == ALREADY_INTERSECTED) {
     Vec p = getIntersectionPoint(l1->p1, l1->p2, l2->p1, l2->p2);
-    double l1_vel_len = Vec_length(l1->velocity);
-    double l2_vel_len = Vec_length(l2->velocity);
-
-    if (Vec_length(Vec_subtract(l1->p1, p))
-        < Vec_length(Vec_subtract(l1->p2, p))) {
-      l1->velocity = Vec_multiply(Vec_normalize(Vec_subtract(l1->p2, p)),
-                                  l1_vel_len);
-    } else {
-      l1->velocity = Vec_multiply(Vec_normalize(Vec_subtract(l1->p1, p)),
-                                  l1_vel_len);
-    }
-    if (Vec_length(Vec_subtract(l2->p1, p))
-        < Vec_length(Vec_subtract(l2->p2, p))) {
-      l2->velocity = Vec_multiply(Vec_normalize(Vec_subtract(l2->p2, p)),
-                                  l2_vel_len);
-    } else {
-      l2->velocity = Vec_multiply(Vec_normalize(Vec_subtract(l2->p1, p)),
-                                  l2_vel_len);
-    }
+    l1->velocity = awayFromPoint(l1, p);
+    l2->velocity = awayFromPoint(l2, p);
     return;
   }
 
@@ -258,11 +706,9 @@ void CollisionWorld_collisionSolver(CollisionWorld* collisionWorld,
   Vec face;
   Vec normal;
   if (intersectionType == L1_WITH_L2) {
-    Vec v = Vec_makeFromLine(*l2);
-    face = Vec_normalize(v);
+    face = l2->face;
   } else {
-    Vec v = Vec_makeFromLine(*l1);
-    face = Vec_normalize(v);
+    face = l1->face;
   }
   normal = Vec_orthogonal(face);
 
@@ -26,14 +26,28 @@
 
 #include "Line.h"
 #include "IntersectionDetection.h"
+#include "IntersectionEventList.h"
+#include "Parallel.h"
 #include "Quadtree.h"
 
-#include <cilk/reducer_opadd.h>
+// Frames between reorderings of the line storage (see
+// CollisionWorld_reorderLines)
+#define LINE_REORDER_INTERVAL 128
+
+// Most frames one step of CollisionWorld_updateLinesAdaptive covers
+#define ADAPTIVE_MAX_FRAMES 64
 
 // need to forward reference due to circularity of these structs
 typedef struct Quadtree Quadtree;
 typedef struct CollisionWorld CollisionWorld;
 
+// A line-line collision solved during the last frame, identified by line IDs.
+typedef struct CollisionEvent {
+  unsigned int id1;
+  unsigned int id2;
+  IntersectionType intersectionType;
+} CollisionEvent;
+
 typedef struct CollisionWorld {
   // Time step used for simulation
   double timeStep;
@@ -45,11 +59,54 @@ typedef struct CollisionWorld {
   
   struct Quadtree* quadtree;
 
+  // Per-NUMA-node slabs holding the lines, or NULL if each line was
+  // allocated on its own.  This CollisionWorld owns the NumaPlacement.
+  struct NumaPlacement* numaPlacement;
+
+  // The block holding the lines once they have been reordered without a
+  // NumaPlacement, or NULL.
+  Line* lineStorage;
+
+  // Lines per task in the parallel loops over lines, or 0 to use the
+  // runtime's default.  Setting it to numOfLines runs those loops serially.
+  unsigned int grainSize;
+
+  // Depth of the quadtree's leaves, and whether LinearQuadtree fills them.
+  // Change them with CollisionWorld_setQuadtree.
+  unsigned int quadtreeDepth;
+  bool linearQuadtree;
+
+  // True while every line's leafMask matches its parallelogram and the
+  // quadtree, so the quadtree can skip testing lines against its leaves
+  bool leafMasksValid;
+
+  // Frames the next step of CollisionWorld_updateLinesAdaptive tries to
+  // cover at once
+  unsigned int stepFrames;
+
+  // The pairs a failed step of several frames found, and how many frames
+  // of that step are left.  Those frames test only these pairs, until one
+  // of them solves a collision.  Steps end before the lines are moved in
+  // memory, so the pairs never outlive their lines.
+  IntersectionEventList candidates;
+  unsigned int candidateFrames;
+
   // Record the total number of line-wall collisions.
   unsigned int numLineWallCollisions;
 
   // Record the total number of line-line intersections.
   unsigned int numLineLineCollisions;
+
+  // If recordEvents is set, the events solved in the last frame, in the
+  // order they were solved.
+  bool recordEvents;
+  CollisionEvent* events;
+  unsigned int numEvents;
+  unsigned int eventCapacity;
+
+  // Occupancy and pair work of the last detection, or NULL if they are not
+  // kept.  This CollisionWorld owns the QuadtreeStats.
+  struct QuadtreeStats* stats;
 } CollisionWorld_t;
 
 typedef struct CollisionWorld CollisionWorld;
@@ -65,21 +122,69 @@ unsigned int CollisionWorld_getNumOfLines(CollisionWorld* collisionWorld);
 // This CollisionWorld becomes owner of the Line* line.
 void CollisionWorld_addLine(CollisionWorld* collisionWorld, Line *line);
 
+// Add several lines into the box, rebuilding the quadtree once instead of
+// after every line.  Must stay under capacity.
+// This CollisionWorld becomes owner of the lines.
+void CollisionWorld_addLines(CollisionWorld* collisionWorld, Line** lines,
+                             const unsigned int numOfLines);
+
+// Rebuild the quadtree with its leaves at the given depth, at most
+// QUADTREE_MAX_DEPTH, filled by LinearQuadtree if linear is set.
+void CollisionWorld_setQuadtree(CollisionWorld* collisionWorld,
+                                unsigned int depth, bool linear);
+
 // Get a line from box.
 Line* CollisionWorld_getLine(CollisionWorld* collisionWorld,
                              const unsigned int index);
 
+// Change the time step, updating every line's parallelogram.
+void CollisionWorld_setTimeStep(CollisionWorld* collisionWorld,
+                                const double timeStep);
+
+// Returns the grain size to use for a parallel loop over n lines.
+int CollisionWorld_grainSize(CollisionWorld* collisionWorld,
+                             const unsigned int n);
+
+// Sort the lines by the Morton order of their midpoints, and move them into
+// one block (or the NUMA slabs) in that order, so lines close in the box are
+// close in memory.  IDs are unchanged.  Call only once all lines are added.
+void CollisionWorld_reorderLines(CollisionWorld* collisionWorld);
+
 // Update lines' situation in the box.
 void CollisionWorld_updateLines(CollisionWorld* collisionWorld);
 
+// Update the lines by up to maxFrames frames in one time step, as long as
+// no line can meet another line or a wall during it, and return the number
+// of frames done.  Otherwise, or if the last try failed, do one frame like
+// CollisionWorld_updateLines.  Each success doubles the step tried next.
+// The frames of a failed step test only the pairs it found, as long as
+// they solve no collision.
+unsigned int CollisionWorld_updateLinesAdaptive(CollisionWorld* collisionWorld,
+                                                unsigned int maxFrames);
+
+// Move the lines frames time steps, bounce them off the walls and sweep
+// them over the time step, in one pass over the lines.  The lines move one
+// time step at a time, so they end up bit for bit where that many single
+// frames would leave them.  Leaf masks are found in the same pass when the
+// quadtree is shallow enough for them.
+void CollisionWorld_advanceLines(CollisionWorld* collisionWorld,
+                                 unsigned int frames,
+                                 ParallelCounter* numCollisions);
+
 // Update position of lines.
 void CollisionWorld_updatePosition(CollisionWorld* collisionWorld);
 
 // Handle line-wall collision.
-void CollisionWorld_lineWallCollision(CollisionWorld* collisionWorld, CILK_C_REDUCER_OPADD_TYPE(int)* numCollisionsReducer);
+void CollisionWorld_lineWallCollision(CollisionWorld* collisionWorld, ParallelCounter* numCollisions);
 
 // Detect line-line intersection.
-void CollisionWorld_detectIntersection(CollisionWorld* collisionWorld, CILK_C_REDUCER_OPADD_TYPE(int)* numCollisionsReducer);
+void CollisionWorld_detectIntersection(CollisionWorld* collisionWorld, ParallelCounter* numCollisions);
+
+// Keep the events solved in each frame in collisionWorld->events.
+void CollisionWorld_recordEvents(CollisionWorld* collisionWorld);
+
+// Keep the stats of each detection in collisionWorld->stats.
+void CollisionWorld_recordStats(CollisionWorld* collisionWorld);
 
 // Get total number of line-wall collisions.
 unsigned int CollisionWorld_getNumLineWallCollisions(
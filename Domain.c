@@ -0,0 +1,404 @@
+/**
+ * Domain.c -- spatial domain decomposition across local processes
+ *
+ * Function definitions in Domain.h
+ **/
+
+#include "Domain.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fasttime.h"
+#include "CollisionWorld.h"
+#include "IntersectionEventList.h"
+#include "LineDemo.h"
+#include "Parallel.h"
+#include "Quadtree.h"
+
+// A rank's private view of the shared state.
+typedef struct Rank {
+  unsigned int rank;
+  unsigned int depth;
+  DomainShared* shared;
+
+  // Shared arrays
+  Line* lines;
+  DomainEvent* events;   // events[rank * eventCapacity + i]
+  DomainExport* exports; // exports[rank * numOfLines + i]
+
+  // Local world; its lines are this rank's view of the shared lines.
+  CollisionWorld* collisionWorld;
+
+  // The quadtree node of every rank, in this rank's copy of the quadtree.
+  Quadtree* subdomains[DOMAIN_MAX_RANKS];
+
+  // Lines this rank owns, and the ghosts it sees from other ranks.
+  Line** owned;
+  unsigned int numOwned;
+  Line** ghosts;
+  unsigned int numGhosts;
+} Rank;
+
+static inline size_t alignUp(size_t size) {
+  return (size + 63) & ~(size_t) 63;
+}
+
+// Collect the nodes at the decomposition depth; rank numbers are the
+// quadrant indices along the path from the root, most significant first.
+static void findSubdomains(Rank* rank, Quadtree* quadtree, unsigned int depth,
+                           unsigned int prefix) {
+  if (depth == rank->depth) {
+    rank->subdomains[prefix] = quadtree;
+    return;
+  }
+  for (int i = 0; i < 4; i++) {
+    findSubdomains(rank, quadtree->quadrants[i], depth + 1, 4 * prefix + i);
+  }
+}
+
+// Whether a line reaches any leaf of a subdomain.  Leaves are tested one by
+// one, the way Quadtree_update assigns lines, since a line can touch a leaf
+// without passing isLineInQuadtree for the leaf's parent.
+static bool isLineInSubdomain(Quadtree* quadtree, Line* line) {
+  if (quadtree->isLeaf) {
+    return isLineInQuadtree(quadtree, line);
+  }
+  for (int i = 0; i < 4; i++) {
+    if (isLineInSubdomain(quadtree->quadrants[i], line)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The rank owning a line is the subdomain containing its midpoint.
+static unsigned int ownerOf(Rank* rank, Line* line) {
+  Vec midpoint = Vec_divide(Vec_add(line->p1, line->p2), 2);
+  Quadtree* quadtree = rank->collisionWorld->quadtree;
+  unsigned int owner = 0;
+  for (int depth = 0; depth < rank->depth; depth++) {
+    Vec center = quadtree->quadrants[3]->upperLeft;
+    unsigned int quadrant = (midpoint.x >= center.x) + 2 * (midpoint.y >= center.y);
+    owner = 4 * owner + quadrant;
+    quadtree = quadtree->quadrants[quadrant];
+  }
+  return owner;
+}
+
+///////////////////////////////////////////////////////////
+// Publish where each owned line is needed next frame, then pick up this
+// rank's ghosts and immigrants.
+static void exchangeLines(Rank* rank) {
+  DomainShared* shared = rank->shared;
+  unsigned int numOfLines = shared->numOfLines;
+  DomainExport* exports = &rank->exports[rank->rank * numOfLines];
+  unsigned int numExports = 0;
+  unsigned int numKept = 0;
+  unsigned int numGhosts = 0;
+
+  for (int i = 0; i < rank->numOwned; i++) {
+    Line* line = rank->owned[i];
+    unsigned int owner = ownerOf(rank, line);
+    uint32_t ghostMask = 0;
+    for (unsigned int r = 0; r < shared->numRanks; r++) {
+      if (r != owner && isLineInSubdomain(rank->subdomains[r], line)) {
+        ghostMask |= (uint32_t) 1 << r;
+      }
+    }
+    if (owner != rank->rank || ghostMask != 0) {
+      exports[numExports].index = line - rank->lines;
+      exports[numExports].ghostMask = ghostMask;
+      exports[numExports].owner = owner;
+      numExports++;
+    }
+    if (owner == rank->rank) {
+      rank->owned[numKept++] = line;
+    } else if (ghostMask & ((uint32_t) 1 << rank->rank)) {
+      // a line leaving this rank can stay behind as a ghost
+      rank->ghosts[numGhosts++] = line;
+    }
+  }
+  rank->numOwned = numKept;
+  shared->numExports[rank->rank] = numExports;
+
+  pthread_barrier_wait(&shared->barrier);
+
+  rank->numGhosts = numGhosts;
+  for (unsigned int r = 0; r < shared->numRanks; r++) {
+    if (r == rank->rank) {
+      continue;
+    }
+    DomainExport* other = &rank->exports[r * numOfLines];
+    for (int i = 0; i < shared->numExports[r]; i++) {
+      Line* line = &rank->lines[other[i].index];
+      if (other[i].owner == rank->rank) {
+        rank->owned[rank->numOwned++] = line;
+      } else if (other[i].ghostMask & ((uint32_t) 1 << rank->rank)) {
+        rank->ghosts[rank->numGhosts++] = line;
+      }
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////
+// Find the collisions in this rank's subdomain and publish them.
+static void findCollisions(Rank* rank) {
+  DomainShared* shared = rank->shared;
+  CollisionWorld* collisionWorld = rank->collisionWorld;
+
+  // the view is the owned lines followed by the ghosts
+  memcpy(collisionWorld->lines, rank->owned, rank->numOwned * sizeof(Line*));
+  memcpy(collisionWorld->lines + rank->numOwned, rank->ghosts,
+         rank->numGhosts * sizeof(Line*));
+  collisionWorld->numOfLines = rank->numOwned + rank->numGhosts;
+
+  ParallelCounter numCollisions;
+  ParallelCounter_init(&numCollisions);
+  IntersectionEventListReducer intersectionEventListReducer;
+  IntersectionEventListReducer_init(&intersectionEventListReducer);
+
+  Quadtree* subdomain = rank->subdomains[rank->rank];
+  Quadtree_update(subdomain);
+  detectCollisionsReducer(subdomain, &intersectionEventListReducer,
+                          &numCollisions);
+
+  IntersectionEventList intersectionEventList =
+      IntersectionEventListReducer_reduce(&intersectionEventListReducer);
+  DomainEvent* events = &rank->events[rank->rank * shared->eventCapacity];
+  unsigned int numEvents = 0;
+  for (IntersectionEventNode* node = intersectionEventList.head; node != NULL;
+       node = node->next) {
+    if (numEvents == shared->eventCapacity) {
+      shared->failed = true;
+      break;
+    }
+    events[numEvents].l1 = node->l1;
+    events[numEvents].l2 = node->l2;
+    events[numEvents].intersectionType = node->intersectionType;
+    numEvents++;
+  }
+  shared->numEvents[rank->rank] = numEvents;
+
+  IntersectionEventList_deleteNodes(&intersectionEventList);
+  IntersectionEventListReducer_destroy(&intersectionEventListReducer);
+  ParallelCounter_destroy(&numCollisions);
+}
+
+static int compareEvents(const void* a, const void* b) {
+  const DomainEvent* event1 = (const DomainEvent*) a;
+  const DomainEvent* event2 = (const DomainEvent*) b;
+  int comp = compareLines(event1->l1, event2->l1);
+  return comp != 0 ? comp : compareLines(event1->l2, event2->l2);
+}
+
+///////////////////////////////////////////////////////////
+// Rank 0 solves every event, in the order a single process would.
+static void solveCollisions(Rank* rank, DomainEvent* scratch) {
+  DomainShared* shared = rank->shared;
+  unsigned int numEvents = 0;
+  for (unsigned int r = 0; r < shared->numRanks; r++) {
+    memcpy(&scratch[numEvents], &rank->events[r * shared->eventCapacity],
+           shared->numEvents[r] * sizeof(DomainEvent));
+    numEvents += shared->numEvents[r];
+  }
+  qsort(scratch, numEvents, sizeof(DomainEvent), compareEvents);
+
+  // a pair straddling subdomains or leaves is found more than once
+  unsigned int numCollisions = 0;
+  for (int i = 0; i < numEvents; i++) {
+    if (i > 0 && compareEvents(&scratch[i - 1], &scratch[i]) == 0) {
+      continue;
+    }
+    CollisionWorld_collisionSolver(rank->collisionWorld, scratch[i].l1,
+                                   scratch[i].l2, scratch[i].intersectionType);
+    numCollisions++;
+  }
+  shared->numLineLineCollisions += numCollisions;
+}
+
+///////////////////////////////////////////////////////////
+// Move the owned lines and bounce them off the walls.
+static void moveLines(Rank* rank) {
+  CollisionWorld* collisionWorld = rank->collisionWorld;
+  memcpy(collisionWorld->lines, rank->owned, rank->numOwned * sizeof(Line*));
+  collisionWorld->numOfLines = rank->numOwned;
+
+  ParallelCounter numCollisions;
+  ParallelCounter_init(&numCollisions);
+  CollisionWorld_updatePosition(collisionWorld);
+  CollisionWorld_lineWallCollision(collisionWorld, &numCollisions);
+  ParallelCounter_destroy(&numCollisions);
+}
+
+static void rankMain(Rank* rank, const unsigned int numFrames) {
+  DomainShared* shared = rank->shared;
+  unsigned int numOfLines = shared->numOfLines;
+
+  rank->collisionWorld = CollisionWorld_new(numOfLines);
+  findSubdomains(rank, rank->collisionWorld->quadtree, 0, 0);
+  rank->owned = malloc(numOfLines * sizeof(Line*));
+  rank->ghosts = malloc(numOfLines * sizeof(Line*));
+  DomainEvent* scratch = NULL;
+  if (rank->rank == 0) {
+    scratch = malloc(shared->numRanks * shared->eventCapacity
+                     * sizeof(DomainEvent));
+  }
+
+  // take every line and let the exchange hand them to their owners
+  rank->numOwned = 0;
+  for (int i = 0; i < numOfLines; i++) {
+    if (ownerOf(rank, &rank->lines[i]) == rank->rank) {
+      rank->owned[rank->numOwned++] = &rank->lines[i];
+    }
+  }
+  exchangeLines(rank);
+
+  for (unsigned int count = 1; ; count++) {
+    findCollisions(rank);
+    pthread_barrier_wait(&shared->barrier);
+    if (shared->failed) {
+      break;
+    }
+    if (rank->rank == 0) {
+      solveCollisions(rank, scratch);
+    }
+    pthread_barrier_wait(&shared->barrier);
+    moveLines(rank);
+    exchangeLines(rank);
+    if (count > numFrames) {
+      break;
+    }
+  }
+  shared->numLineWallCollisions[rank->rank] =
+      rank->collisionWorld->numLineWallCollisions;
+  pthread_barrier_wait(&shared->barrier);
+
+  // the local world does not own the shared lines
+  rank->collisionWorld->numOfLines = 0;
+  CollisionWorld_delete(rank->collisionWorld);
+  free(rank->owned);
+  free(rank->ghosts);
+  free(scratch);
+}
+
+int Domain_main(const unsigned int numRanks, const unsigned int numFrames) {
+  unsigned int depth = 0;
+  while ((1u << (2 * depth)) < numRanks) {
+    depth++;
+  }
+  if ((1u << (2 * depth)) != numRanks || depth > QUADTREE_DEPTH
+      || numRanks > DOMAIN_MAX_RANKS) {
+    fprintf(stderr, "Number of processes must be 1, 4 or 16\n");
+    return -1;
+  }
+
+  // size the mapping from the scene header
+  FILE* fin = fopen("line.in", "r");
+  unsigned int numOfLines;
+  if (fin == NULL || fscanf(fin, "%u", &numOfLines) != 1 || numOfLines == 0) {
+    fprintf(stderr, "line.in: expected the number of lines\n");
+    return -1;
+  }
+  fclose(fin);
+
+  unsigned int eventCapacity = 4 * numOfLines + 1024;
+  size_t linesOffset = alignUp(sizeof(DomainShared));
+  size_t eventsOffset = linesOffset + alignUp(numOfLines * sizeof(Line));
+  size_t exportsOffset = eventsOffset
+      + alignUp(numRanks * eventCapacity * sizeof(DomainEvent));
+  size_t size = exportsOffset + numRanks * numOfLines * sizeof(DomainExport);
+
+  char* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  DomainShared* shared = (DomainShared*) mapping;
+  memset(shared, 0, sizeof(DomainShared));
+  shared->numOfLines = numOfLines;
+  shared->numRanks = numRanks;
+  shared->eventCapacity = eventCapacity;
+
+  pthread_barrierattr_t barrierAttr;
+  pthread_barrierattr_init(&barrierAttr);
+  pthread_barrierattr_setpshared(&barrierAttr, PTHREAD_PROCESS_SHARED);
+  pthread_barrier_init(&shared->barrier, &barrierAttr, numRanks);
+  pthread_barrierattr_destroy(&barrierAttr);
+
+  Rank rank;
+  rank.depth = depth;
+  rank.shared = shared;
+  rank.lines = (Line*) (mapping + linesOffset);
+  rank.events = (DomainEvent*) (mapping + eventsOffset);
+  rank.exports = (DomainExport*) (mapping + exportsOffset);
+
+  // Fork before anything starts the worker pool; each rank starts its own.
+  fflush(stdout);
+  pid_t children[DOMAIN_MAX_RANKS];
+  rank.rank = 0;
+  for (unsigned int r = 1; r < numRanks; r++) {
+    children[r] = fork();
+    if (children[r] < 0) {
+      perror("fork");
+      exit(-1);
+    }
+    if (children[r] == 0) {
+      rank.rank = r;
+      break;
+    }
+  }
+
+  // rank 0 loads the scene into shared memory
+  if (rank.rank == 0) {
+    LineDemo* lineDemo = LineDemo_new();
+    LineDemo_initLine(lineDemo);
+    assert(LineDemo_getNumOfLines(lineDemo) == numOfLines);
+    for (int i = 0; i < numOfLines; i++) {
+      rank.lines[i] = *LineDemo_getLine(lineDemo, i);
+    }
+    LineDemo_delete(lineDemo);
+  }
+  pthread_barrier_wait(&shared->barrier);
+
+  const fasttime_t start_time = gettime();
+  rankMain(&rank, numFrames);
+  const fasttime_t end_time = gettime();
+
+  if (rank.rank != 0) {
+    _exit(0);
+  }
+  int status = 0;
+  for (unsigned int r = 1; r < numRanks; r++) {
+    int childStatus;
+    waitpid(children[r], &childStatus, 0);
+    if (!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != 0) {
+      status = -1;
+    }
+  }
+  if (shared->failed) {
+    fprintf(stderr, "Event slab overflowed\n");
+    status = -1;
+  }
+
+  unsigned int numLineWallCollisions = 0;
+  for (unsigned int r = 0; r < numRanks; r++) {
+    numLineWallCollisions += shared->numLineWallCollisions[r];
+  }
+  printf("---- RESULTS ----\n");
+  printf("Elapsed execution time: %fs on %u processes\n",
+         tdiff(start_time, end_time), numRanks);
+  printf("%u Line-Wall Collisions\n", numLineWallCollisions);
+  printf("%u Line-Line Collisions\n", shared->numLineLineCollisions);
+  printf("---- END RESULTS ----\n");
+
+  pthread_barrier_destroy(&shared->barrier);
+  munmap(mapping, size);
+  return status;
+}
@@ -0,0 +1,81 @@
+/**
+ * Domain.h -- spatial domain decomposition across local processes
+ *
+ * The box is split into the 4^k nodes at depth k of the quadtree, and each
+ * node is simulated by its own process (rank).  Line state lives in a
+ * shared memory mapping created before the ranks are forked, so a Line*
+ * means the same line in every rank.
+ *
+ * Each rank owns the lines whose midpoint lies in its subdomain.  Every
+ * frame, a rank:
+ *   1. detects collisions among its own lines and the ghost lines whose
+ *      parallelograms reach into its subdomain from elsewhere, and
+ *      publishes them in its event slab;
+ *   2. waits while rank 0 merges, sorts and de-duplicates all slabs and
+ *      solves the events in ID order, as CollisionWorld_detectIntersection
+ *      does;
+ *   3. moves its own lines and bounces them off the walls;
+ *   4. publishes, for each of its lines, the ranks that need it as a ghost
+ *      and the rank that owns it next, then picks up its ghosts and the
+ *      lines migrating in from the other ranks.
+ *
+ * Because subdomains are quadtree nodes, every rank sees exactly the leaves
+ * of the single-process quadtree, and the results match a normal run.
+ **/
+
+#ifndef DOMAIN_H_
+#define DOMAIN_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "CollisionWorld.h"
+#include "IntersectionDetection.h"
+#include "Line.h"
+
+// Ranks are identified by a bit in a uint32_t.
+#define DOMAIN_MAX_RANKS 16
+
+// A collision found by one rank.
+typedef struct DomainEvent {
+  Line* l1;
+  Line* l2;
+  IntersectionType intersectionType;
+} DomainEvent;
+
+// A line a rank hands to other ranks at the end of a frame.
+typedef struct DomainExport {
+  unsigned int index;
+
+  // Ranks that need the line as a ghost next frame.
+  uint32_t ghostMask;
+
+  // Rank that owns the line next frame.
+  unsigned int owner;
+} DomainExport;
+
+// Header of the shared mapping.  The lines, the event slabs and the export
+// lists follow it in the same mapping.
+typedef struct DomainShared {
+  pthread_barrier_t barrier;
+
+  unsigned int numOfLines;
+  unsigned int numRanks;
+  unsigned int eventCapacity;
+
+  // Set by a rank whose event slab overflowed.
+  bool failed;
+
+  unsigned int numLineLineCollisions;
+  unsigned int numLineWallCollisions[DOMAIN_MAX_RANKS];
+  unsigned int numEvents[DOMAIN_MAX_RANKS];
+  unsigned int numExports[DOMAIN_MAX_RANKS];
+} DomainShared;
+
+// Runs the scene in line.in for numFrames frames on numRanks processes
+// (1, 4 or 16) and prints the results like a single-process run.  Returns
+// the exit status.
+int Domain_main(const unsigned int numRanks, const unsigned int numFrames);
+
+#endif  // DOMAIN_H_
@@ -0,0 +1,114 @@
+/**
+ * Engine.c -- run a line simulation from memory, without files or a display
+ *
+ * Function definitions in Engine.h
+ **/
+
+#include "Engine.h"
+
+#include <stdlib.h>
+
+#include "CollisionWorld.h"
+#include "Line.h"
+#include "LineDemo.h"
+
+struct Engine {
+  LineDemo* lineDemo;
+};
+
+Engine* Engine_new(const EngineLine* lines, unsigned int numOfLines) {
+  if (numOfLines == 0) {
+    return NULL;
+  }
+  Engine* engine = malloc(sizeof(Engine));
+  Line* storage = malloc(numOfLines * sizeof(Line));
+  Line** added = malloc(numOfLines * sizeof(Line*));
+  LineDemo* lineDemo = LineDemo_new();
+  CollisionWorld* collisionWorld = CollisionWorld_new(numOfLines);
+  if (engine == NULL || storage == NULL || added == NULL || lineDemo == NULL
+      || collisionWorld == NULL) {
+    free(engine);
+    free(storage);
+    free(added);
+    free(lineDemo);
+    if (collisionWorld != NULL) {
+      CollisionWorld_delete(collisionWorld);
+    }
+    return NULL;
+  }
+
+  // the lines are converted the way LineDemo reads line.in
+  for (unsigned int i = 0; i < numOfLines; i++) {
+    Line* line = &storage[i];
+    windowToBox(&line->p1.x, &line->p1.y, lines[i].x1, lines[i].y1);
+    windowToBox(&line->p2.x, &line->p2.y, lines[i].x2, lines[i].y2);
+    velocityWindowToBox(&line->velocity.x, &line->velocity.y,
+                        lines[i].vx, lines[i].vy);
+    line->color = lines[i].color;
+    line->id = i;
+    added[i] = line;
+  }
+
+  // one block of lines, freed by the collision world like a reordered one
+  CollisionWorld_addLines(collisionWorld, added, numOfLines);
+  collisionWorld->lineStorage = storage;
+  free(added);
+
+  lineDemo->collisionWorld = collisionWorld;
+  engine->lineDemo = lineDemo;
+  return engine;
+}
+
+void Engine_delete(Engine* engine) {
+  LineDemo_delete(engine->lineDemo);
+  free(engine);
+}
+
+void Engine_setTimeStep(Engine* engine, double timeStep) {
+  CollisionWorld_setTimeStep(engine->lineDemo->collisionWorld, timeStep);
+}
+
+void Engine_setMaxStepFrames(Engine* engine, unsigned int maxStepFrames) {
+  LineDemo_setMaxStepFrames(engine->lineDemo, maxStepFrames);
+}
+
+///////////////////////////////////////////////////////////
+// LineDemo_update stops once the frame count passes numFrames, so the
+// last frame to run is numFrames - 1 from here.
+void Engine_step(Engine* engine, unsigned int numFrames,
+                 EngineCounters* counters) {
+  LineDemo* lineDemo = engine->lineDemo;
+  if (numFrames > 0) {
+    LineDemo_setNumFrames(lineDemo, lineDemo->count + numFrames - 1);
+    while (LineDemo_update(lineDemo)) {
+    }
+  }
+  if (counters != NULL) {
+    Engine_getCounters(engine, counters);
+  }
+}
+
+void Engine_getCounters(Engine* engine, EngineCounters* counters) {
+  LineDemo* lineDemo = engine->lineDemo;
+  counters->frame = lineDemo->count;
+  counters->numLineWallCollisions =
+      LineDemo_getNumLineWallCollisions(lineDemo);
+  counters->numLineLineCollisions =
+      LineDemo_getNumLineLineCollisions(lineDemo);
+}
+
+///////////////////////////////////////////////////////////
+// The lines are reordered in memory as the simulation runs; their IDs
+// still are the order they were given in.
+void Engine_getLines(Engine* engine, EngineLine* lines) {
+  CollisionWorld* collisionWorld = engine->lineDemo->collisionWorld;
+  for (unsigned int i = 0; i < collisionWorld->numOfLines; i++) {
+    Line* line = collisionWorld->lines[i];
+    EngineLine* out = &lines[line->id];
+    boxToWindow(&out->x1, &out->y1, line->p1.x, line->p1.y);
+    boxToWindow(&out->x2, &out->y2, line->p2.x, line->p2.y);
+    velocityBoxToWindow(&out->vx, &out->vy, line->velocity.x,
+                        line->velocity.y);
+    out->color = line->color;
+  }
+}
@@ -0,0 +1,72 @@
+/**
+ * Engine.h -- run a line simulation from memory, without files or a display
+ *
+ * The entry point of libscreensaver (make lib).  A caller hands over the
+ * scene as an array of lines, steps it any number of frames at a time and
+ * reads the collision counts and line positions back into its own
+ * buffers.  The simulation is the same as Screensaver's: `Screensaver n`
+ * on a scene finds the same collisions as Engine_step(engine, n + 1, ...)
+ * on it, since Screensaver also simulates frame 0.
+ *
+ * Engines are independent, but they share one worker pool.  With the
+ * builtin pool (PARALLEL=builtin), engines stepped from different threads
+ * take turns: each parallel loop holds the pool's callerLock until it
+ * ends, so they do not run at the same time.
+ **/
+
+#ifndef ENGINE_H_
+#define ENGINE_H_
+
+#include "Line.h"
+
+// A line of a scene, in the window coordinates and units of line.in
+typedef struct EngineLine {
+  double x1;
+  double y1;
+  double x2;
+  double y2;
+
+  // Pixels per time step
+  double vx;
+  double vy;
+
+  Color color;
+} EngineLine;
+
+typedef struct EngineCounters {
+  // Frames simulated since the engine was made
+  unsigned int frame;
+
+  unsigned int numLineWallCollisions;
+  unsigned int numLineLineCollisions;
+} EngineCounters;
+
+typedef struct Engine Engine;
+
+// Makes an engine simulating a copy of lines[0..numOfLines).  Returns NULL
+// if there are no lines or memory runs out.
+Engine* Engine_new(const EngineLine* lines, unsigned int numOfLines);
+
+void Engine_delete(Engine* engine);
+
+// Change the time step of the frames to come.
+void Engine_setTimeStep(Engine* engine, double timeStep);
+
+// Let one update cover up to maxStepFrames frames while nothing can
+// collide (see LineDemo_setMaxStepFrames).  Steps still end on the frame
+// asked for.
+void Engine_setMaxStepFrames(Engine* engine, unsigned int maxStepFrames);
+
+// Simulates numFrames more frames.  If counters is not NULL, the totals
+// so far are written to it.
+void Engine_step(Engine* engine, unsigned int numFrames,
+                 EngineCounters* counters);
+
+// Writes the totals so far to counters.
+void Engine_getCounters(Engine* engine, EngineCounters* counters);
+
+// Writes the current position and velocity of every line to
+// lines[0..numOfLines), in the order they were given to Engine_new.
+void Engine_getLines(Engine* engine, EngineLine* lines);
+
+#endif  // ENGINE_H_
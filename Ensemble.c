@@ -0,0 +1,163 @@
+/**
+ * Ensemble.c -- run many independent line simulations in one process
+ *
+ * Function definitions in Ensemble.h
+ **/
+
+#include "Ensemble.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fasttime.h"
+#include "CollisionWorld.h"
+#include "LineDemo.h"
+#include "Parallel.h"
+
+#define MAX_MANIFEST_LINE 4096
+
+// Load one scene; returns false if its file cannot be read.
+static bool loadScene(EnsembleScene* scene, const char* path,
+                      unsigned int numFrames, double timeStep) {
+  scene->path = strdup(path);
+  scene->elapsed = 0;
+  scene->lineDemo = LineDemo_new();
+  if (!LineDemo_createLinesFromFile(scene->lineDemo, path)) {
+    return false;
+  }
+  LineDemo_setNumFrames(scene->lineDemo, numFrames);
+
+  CollisionWorld* collisionWorld = scene->lineDemo->collisionWorld;
+  if (timeStep > 0) {
+    CollisionWorld_setTimeStep(collisionWorld, timeStep);
+  }
+  if (collisionWorld->numOfLines < ENSEMBLE_SERIAL_LINES) {
+    collisionWorld->grainSize = collisionWorld->numOfLines;
+  }
+  return true;
+}
+
+Ensemble* Ensemble_new(const char* manifestPath) {
+  FILE* fin = fopen(manifestPath, "r");
+  if (fin == NULL) {
+    perror(manifestPath);
+    return NULL;
+  }
+
+  Ensemble* ensemble = malloc(sizeof(Ensemble));
+  if (ensemble == NULL) {
+    fclose(fin);
+    return NULL;
+  }
+  ensemble->scenes = NULL;
+  ensemble->numOfScenes = 0;
+
+  unsigned int capacity = 0;
+  char buffer[MAX_MANIFEST_LINE];
+  char path[MAX_MANIFEST_LINE];
+  int lineNumber = 0;
+  while (fgets(buffer, sizeof(buffer), fin) != NULL) {
+    lineNumber++;
+    char* comment = strchr(buffer, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+
+    unsigned int numFrames;
+    double timeStep = 0;
+    int fields = sscanf(buffer, "%s %u %lf", path, &numFrames, &timeStep);
+    if (fields <= 0) {
+      continue;
+    }
+    if (fields < 2) {
+      fprintf(stderr, "%s:%d: expected <scene> <frames> [time step]\n",
+              manifestPath, lineNumber);
+      fclose(fin);
+      Ensemble_delete(ensemble);
+      return NULL;
+    }
+
+    if (ensemble->numOfScenes == capacity) {
+      capacity = capacity == 0 ? 16 : 2 * capacity;
+      ensemble->scenes = realloc(ensemble->scenes,
+                                 capacity * sizeof(EnsembleScene));
+    }
+    EnsembleScene* scene = &ensemble->scenes[ensemble->numOfScenes++];
+    if (!loadScene(scene, path, numFrames, timeStep)) {
+      fclose(fin);
+      Ensemble_delete(ensemble);
+      return NULL;
+    }
+  }
+  fclose(fin);
+  return ensemble;
+}
+
+void Ensemble_delete(Ensemble* ensemble) {
+  for (int i = 0; i < ensemble->numOfScenes; i++) {
+    free(ensemble->scenes[i].path);
+    if (ensemble->scenes[i].lineDemo->collisionWorld != NULL) {
+      LineDemo_delete(ensemble->scenes[i].lineDemo);
+    } else {
+      free(ensemble->scenes[i].lineDemo);
+    }
+  }
+  free(ensemble->scenes);
+  free(ensemble);
+}
+
+// Estimated work of a scene, for ordering.
+static double sceneCost(EnsembleScene* scene) {
+  double numOfLines = LineDemo_getNumOfLines(scene->lineDemo);
+  return numOfLines * numOfLines * scene->lineDemo->numFrames;
+}
+
+static int compareSceneCost(const void* a, const void* b) {
+  double costA = sceneCost(*(EnsembleScene**) a);
+  double costB = sceneCost(*(EnsembleScene**) b);
+  return costA < costB ? 1 : (costA > costB ? -1 : 0);
+}
+
+// Run scenes [begin, end) of the order.
+static void runScenes(void* context, int begin, int end) {
+  EnsembleScene** order = (EnsembleScene**) context;
+  for (int i = begin; i < end; i++) {
+    EnsembleScene* scene = order[i];
+    const fasttime_t start_time = gettime();
+    while (LineDemo_update(scene->lineDemo)) {
+    }
+    scene->elapsed = tdiff(start_time, gettime());
+  }
+}
+
+///////////////////////////////////////////////////////////
+// Run every scene as one task on the shared worker pool.  Scenes are
+// started most expensive first, so the long ones are not left running
+// alone at the end; idle workers steal from the parallel loops inside the
+// large worlds.
+void Ensemble_run(Ensemble* ensemble) {
+  EnsembleScene** order = malloc(ensemble->numOfScenes * sizeof(EnsembleScene*));
+  for (int i = 0; i < ensemble->numOfScenes; i++) {
+    order[i] = &ensemble->scenes[i];
+  }
+  qsort(order, ensemble->numOfScenes, sizeof(EnsembleScene*), compareSceneCost);
+
+  Parallel_for(0, ensemble->numOfScenes, 1, runScenes, order);
+  free(order);
+}
+
+void Ensemble_printResults(Ensemble* ensemble) {
+  printf("---- ENSEMBLE RESULTS ----\n");
+  for (int i = 0; i < ensemble->numOfScenes; i++) {
+    EnsembleScene* scene = &ensemble->scenes[i];
+    LineDemo* lineDemo = scene->lineDemo;
+    printf("%s: %u frames, time step %g, %fs, "
+           "%u Line-Wall Collisions, %u Line-Line Collisions\n",
+           scene->path, lineDemo->numFrames,
+           lineDemo->collisionWorld->timeStep, scene->elapsed,
+           LineDemo_getNumLineWallCollisions(lineDemo),
+           LineDemo_getNumLineLineCollisions(lineDemo));
+  }
+  printf("---- END ENSEMBLE RESULTS ----\n");
+}
@@ -0,0 +1,50 @@
+/**
+ * Ensemble.h -- run many independent line simulations in one process
+ *
+ * An ensemble is described by a manifest with one scene per line:
+ *
+ *   # scene file   frames   [time step]
+ *   line.in        4000
+ *   line.in        4000     0.25
+ *
+ * Every scene gets its own CollisionWorld.  All scenes are scheduled on the
+ * same worker pool: scenes with fewer than ENSEMBLE_SERIAL_LINES lines
+ * run as a single task, larger ones also use parallelism within the world.
+ **/
+
+#ifndef ENSEMBLE_H_
+#define ENSEMBLE_H_
+
+#include "LineDemo.h"
+
+// Scenes smaller than this run their parallel loops serially.
+#define ENSEMBLE_SERIAL_LINES 256
+
+typedef struct EnsembleScene {
+  // Path of the scene file, owned by the scene.
+  char* path;
+
+  LineDemo* lineDemo;
+
+  // Wall-clock seconds the scene took, once run.
+  double elapsed;
+} EnsembleScene;
+
+typedef struct Ensemble {
+  EnsembleScene* scenes;
+  unsigned int numOfScenes;
+} Ensemble;
+
+// Loads every scene in the manifest.  Returns NULL if the manifest or any
+// scene cannot be read.
+Ensemble* Ensemble_new(const char* manifestPath);
+
+void Ensemble_delete(Ensemble* ensemble);
+
+// Runs every scene to completion.
+void Ensemble_run(Ensemble* ensemble);
+
+// Prints the collision counts of every scene.
+void Ensemble_printResults(Ensemble* ensemble);
+
+#endif  // ENSEMBLE_H_
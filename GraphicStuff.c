@@ -22,15 +22,35 @@
 
 #include "GraphicStuff.h"
 
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 
 #include "Line.h"
 #include "LineDemo.h"
+#include "Parallel.h"
 
 static LineDemo *gLineDemo = NULL;
-XSegment *segments = NULL;
+
+// A frame of segments bucketed by color, one XDrawSegments call per bucket.
+typedef struct SegmentBuffer {
+  XSegment *segments[2];
+} SegmentBuffer;
+
+// Two buffers so that one frame can be drawn while the next is filled.
+// Colors never change, so each line ID is assigned a fixed slot in the
+// bucket of its color.
+SegmentBuffer segmentBuffers[2];
+unsigned int numSegments[2] = { 0, 0 };
+unsigned int *segmentSlots = NULL;
 
 Display *display;
 
@@ -45,69 +65,209 @@ int visibility;
 int windowwidth;
 int windowheight;
 
+// Graphics contexts, allocated once.
+GC colorGCs[2];
+GC backgroundGC;
+
+// Optional back buffer, in MIT-SHM shared memory when the server allows.
+bool doubleBuffer = false;
+Pixmap backBuffer;
+bool shmAttached = false;
+XShmSegmentInfo shmInfo;
+
+// Pipelined mode: a render thread draws pendingFrame while the main thread
+// simulates the next frame.  pendingFrame is NULL while the renderer is idle.
+pthread_t renderThread;
+pthread_mutex_t renderLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t renderCond = PTHREAD_COND_INITIALIZER;
+SegmentBuffer *pendingFrame = NULL;
+bool renderStop = false;
+
+// Written to once the simulation is over, so that a render thread waiting
+// for its unmapped window to come back gives up instead of keeping the
+// main thread waiting for the last frame.  Unused (-1) otherwise.
+int renderWake[2] = { -1, -1 };
+
+// Assign every line a slot in the segment bucket of its color.
+static void allocateSegments() {
+  unsigned int nsegments = LineDemo_getNumOfLines(gLineDemo);
+
+  numSegments[RED] = 0;
+  numSegments[GRAY] = 0;
+  segmentSlots = malloc(nsegments * sizeof(unsigned int));
+  for (unsigned int i = 0; i < nsegments; i++) {
+    Line *line = LineDemo_getLine(gLineDemo, i);
+    assert(line->id < nsegments);
+    segmentSlots[line->id] = numSegments[line->color]++;
+  }
+  for (int i = 0; i < 2; i++) {
+    segmentBuffers[i].segments[RED] = malloc(numSegments[RED] * sizeof(XSegment));
+    segmentBuffers[i].segments[GRAY] = malloc(numSegments[GRAY] * sizeof(XSegment));
+  }
+}
+
+// Convert lines [begin, end) into their slots.
+static void fillSegmentRange(void *context, int begin, int end) {
+  SegmentBuffer *buffer = (SegmentBuffer *) context;
+  for (int i = begin; i < end; i++) {
+    Line *line = LineDemo_getLine(gLineDemo, i);
+    XSegment *segment = &buffer->segments[line->color][segmentSlots[line->id]];
+    window_dimension px1;
+    window_dimension py1;
+    window_dimension px2;
+    window_dimension py2;
+
+    // Convert box coordinates to window coordinates.
+    boxToWindow(&px1, &py1, line->p1.x, line->p1.y);
+    boxToWindow(&px2, &py2, line->p2.x, line->p2.y);
+
+    // Convert doubles to short ints and store into segments.
+    segment->x1 = (int16_t) px1;
+    segment->y1 = (int16_t) py1;
+    segment->x2 = (int16_t) px2;
+    segment->y2 = (int16_t) py2;
+  }
+}
+
+// Convert every line into its slot in one parallel pass.
+static void fillSegments(SegmentBuffer *buffer) {
+  unsigned int nsegments = LineDemo_getNumOfLines(gLineDemo);
+  if (segmentSlots == NULL) {
+    allocateSegments();
+  }
+  Parallel_for(0, nsegments, 0, fillSegmentRange, buffer);
+}
+
+static void drawSegments(Display *display, Drawable drawable,
+                         SegmentBuffer *buffer) {
+  if (doubleBuffer) {
+    XFillRectangle(display, backBuffer, backgroundGC, 0, 0, WINDOW_WIDTH,
+                   WINDOW_HEIGHT);
+    XDrawSegments(display, backBuffer, colorGCs[RED], buffer->segments[RED],
+                  numSegments[RED]);
+    XDrawSegments(display, backBuffer, colorGCs[GRAY], buffer->segments[GRAY],
+                  numSegments[GRAY]);
+    XCopyArea(display, backBuffer, drawable, backgroundGC, 0, 0, WINDOW_WIDTH,
+              WINDOW_HEIGHT, 0, 0);
+  } else {
+    XClearWindow(display, window);
+    XDrawSegments(display, drawable, colorGCs[RED], buffer->segments[RED],
+                  numSegments[RED]);
+    XDrawSegments(display, drawable, colorGCs[GRAY], buffer->segments[GRAY],
+                  numSegments[GRAY]);
+  }
+  XSync(display, 0);
+}
+
 static void drawLineSegments(Display *display, Drawable drawable) {
-  Line *line;
-  unsigned int nsegments;
-  window_dimension px1;
-  window_dimension py1;
-  window_dimension px2;
-  window_dimension py2;
-
-  Colormap cmap;
+  fillSegments(&segmentBuffers[0]);
+  drawSegments(display, drawable, &segmentBuffers[0]);
+}
+
+static GC createColorGC(Colormap cmap, const char *name) {
   XGCValues gcval;
   XColor color;
   XColor ignore;
-  int64_t fgcolor;
-  GC gray;
-  GC red;
 
-  cmap = DefaultColormap(display, screen);
-  XAllocNamedColor(display, cmap, "gray", &color, &ignore);
-  fgcolor = color.pixel;
-  gcval.foreground = fgcolor;
-  gray = XCreateGC(display, window, GCForeground, &gcval);
+  XAllocNamedColor(display, cmap, name, &color, &ignore);
+  gcval.foreground = color.pixel;
+  return XCreateGC(display, window, GCForeground, &gcval);
+}
 
-  XAllocNamedColor(display, cmap, "dark red", &color, &ignore);
-  fgcolor = color.pixel;
-  gcval.foreground = fgcolor;
-  red = XCreateGC(display, window, GCForeground, &gcval);
+// Set by trapShmError when the server refuses XShmAttach.  A remote or
+// sandboxed server cannot map our segment, and says so only through an
+// asynchronous BadAccess that would otherwise kill the client.
+static bool shmFailed = false;
 
-  nsegments = LineDemo_getNumOfLines(gLineDemo);
-  if (segments == NULL) {
-    segments = malloc(nsegments * sizeof(XSegment));
+static int trapShmError(Display *display, XErrorEvent *error) {
+  shmFailed = true;
+  return 0;
+}
+
+// Attach a shared memory pixmap as the back buffer.  Returns false, with
+// nothing left attached, if the server cannot share memory with us.
+static bool attachShmBackBuffer() {
+  int major;
+  int minor;
+  Bool sharedPixmaps;
+
+  if (!XShmQueryVersion(display, &major, &minor, &sharedPixmaps)
+      || !sharedPixmaps || XShmPixmapFormat(display) != ZPixmap) {
+    return false;
+  }
+  XImage *image = XShmCreateImage(display, DefaultVisual(display, screen),
+                                  depth, ZPixmap, NULL, &shmInfo,
+                                  WINDOW_WIDTH, WINDOW_HEIGHT);
+  if (image == NULL) {
+    return false;
+  }
+  shmInfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height,
+                         IPC_CREAT | 0600);
+  XDestroyImage(image);
+  if (shmInfo.shmid < 0) {
+    return false;
+  }
+  shmInfo.shmaddr = shmat(shmInfo.shmid, NULL, 0);
+  shmInfo.readOnly = False;
+  if (shmInfo.shmaddr == (char *) -1) {
+    shmctl(shmInfo.shmid, IPC_RMID, NULL);
+    return false;
   }
-  XClearWindow(display, window);
-  for (unsigned int i = 0; i < nsegments; i++) {
-    line = LineDemo_getLine(gLineDemo, i);
 
-    // Convert box coordinates to window coordinates.
-    boxToWindow(&px1, &py1, line->p1.x, line->p1.y);
-    boxToWindow(&px2, &py2, line->p2.x, line->p2.y);
+  // Round trip so any error from the attach arrives under our handler.
+  XSync(display, 0);
+  shmFailed = false;
+  XErrorHandler oldHandler = XSetErrorHandler(trapShmError);
+  Bool attached = XShmAttach(display, &shmInfo);
+  XSync(display, 0);
+  XSetErrorHandler(oldHandler);
 
-    // Convert doubles to short ints and store into segments.
-    segments[0].x1 = (int16_t) px1;
-    segments[0].y1 = (int16_t) py1;
-    segments[0].x2 = (int16_t) px2;
-    segments[0].y2 = (int16_t) py2;
-
-    // Set line color.
-    switch (line->color) {
-      case RED:
-        XDrawSegments(display, drawable, red, segments, 1);
-        break;
-      case GRAY:
-        XDrawSegments(display, drawable, gray, segments, 1);
-        break;
+  // The segment goes away once both sides detach.
+  shmctl(shmInfo.shmid, IPC_RMID, NULL);
+  if (!attached || shmFailed) {
+    shmdt(shmInfo.shmaddr);
+    return false;
+  }
+  backBuffer = XShmCreatePixmap(display, window, shmInfo.shmaddr, &shmInfo,
+                                WINDOW_WIDTH, WINDOW_HEIGHT, depth);
+  return true;
+}
+
+// Create the back buffer as a shared memory pixmap if the server supports
+// them, otherwise as an ordinary pixmap.
+static void createBackBuffer() {
+  shmAttached = attachShmBackBuffer();
+  if (!shmAttached) {
+    backBuffer = XCreatePixmap(display, window, WINDOW_WIDTH, WINDOW_HEIGHT,
+                               depth);
+  }
+}
+
+// Wait until an event arrives.  Returns false, without one, if renderWake
+// was written to.
+static bool waitForEvent() {
+  struct pollfd fds[2] = {
+    { ConnectionNumber(display), POLLIN, 0 },
+    { renderWake[0], POLLIN, 0 }
+  };
+  while (XPending(display) == 0) {
+    poll(fds, 2, -1);
+    if (fds[1].revents & POLLIN) {
+      return false;
     }
   }
-  XSync(display, 0);
+  return true;
 }
 
+// Handle pending events, and wait while the window is unmapped or hidden.
 static void checkEvent() {
   XEvent event;
   bool block = false;
 
   while ((XPending(display) > 0) || (block == true)) {
+    if (!waitForEvent()) {
+      return;
+    }
     XNextEvent(display, &event);
     switch (event.type) {
       case ReparentNotify:
@@ -188,6 +348,80 @@ static void graphicMainLoop(bool imageOnlyFlag) {
   }
 }
 
+// The render thread owns the display while the pipelined loop runs.
+static void *renderMain(void *arg) {
+  pthread_mutex_lock(&renderLock);
+  while (true) {
+    while (pendingFrame == NULL && !renderStop) {
+      pthread_cond_wait(&renderCond, &renderLock);
+    }
+    if (pendingFrame == NULL) {
+      break;
+    }
+    SegmentBuffer *frame = pendingFrame;
+    pthread_mutex_unlock(&renderLock);
+
+    checkEvent();
+    drawSegments(display, window, frame);
+
+    pthread_mutex_lock(&renderLock);
+    pendingFrame = NULL;
+    pthread_cond_broadcast(&renderCond);
+  }
+  pthread_mutex_unlock(&renderLock);
+  return NULL;
+}
+
+// Hand a filled buffer to the render thread once it has finished the
+// previous one.
+static void submitFrame(SegmentBuffer *frame) {
+  pthread_mutex_lock(&renderLock);
+  while (pendingFrame != NULL) {
+    pthread_cond_wait(&renderCond, &renderLock);
+  }
+  pendingFrame = frame;
+  pthread_cond_broadcast(&renderCond);
+  pthread_mutex_unlock(&renderLock);
+}
+
+// Draw frame N on the render thread while frame N+1 is simulated, so the
+// frame rate approaches max(render, simulate) rather than their sum.
+static void graphicPipelinedLoop() {
+  int back = 0;
+
+  fillSegments(&segmentBuffers[back]);
+  if (pipe(renderWake) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  pthread_create(&renderThread, NULL, renderMain, NULL);
+  while (true) {
+    submitFrame(&segmentBuffers[back]);
+    back = 1 - back;
+    if (!LineDemo_update(gLineDemo)) {
+      break;
+    }
+    // The renderer finished with this buffer before taking the last one.
+    fillSegments(&segmentBuffers[back]);
+  }
+
+  // The last frame is drawn unless the window is unmapped.
+  if (write(renderWake[1], "", 1) != 1) {
+    perror("write");
+  }
+  pthread_mutex_lock(&renderLock);
+  while (pendingFrame != NULL) {
+    pthread_cond_wait(&renderCond, &renderLock);
+  }
+  renderStop = true;
+  pthread_cond_broadcast(&renderCond);
+  pthread_mutex_unlock(&renderLock);
+  pthread_join(renderThread, NULL);
+  close(renderWake[0]);
+  close(renderWake[1]);
+  renderWake[0] = renderWake[1] = -1;
+}
+
 static void graphicInit(int *argc, char *argv[]) {
   // Initialization
   int64_t fgcolor;
@@ -221,20 +455,55 @@ static void graphicInit(int *argc, char *argv[]) {
 
   XMapWindow(display, window);
 
+  Colormap cmap = DefaultColormap(display, screen);
+  colorGCs[GRAY] = createColorGC(cmap, "gray");
+  colorGCs[RED] = createColorGC(cmap, "dark red");
+  XGCValues gcval;
+  gcval.foreground = bgcolor;
+  backgroundGC = XCreateGC(display, window, GCForeground, &gcval);
+  if (doubleBuffer) {
+    createBackBuffer();
+  }
+
   XClearWindow(display, window);
   XSync(display, 0);
 }
 
-void graphicMain(int argc, char *argv[], LineDemo *lineDemo, bool imageOnlyFlag) {
+static void graphicCleanup() {
+  if (doubleBuffer) {
+    XFreePixmap(display, backBuffer);
+    if (shmAttached) {
+      XShmDetach(display, &shmInfo);
+      XSync(display, 0);
+      shmdt(shmInfo.shmaddr);
+    }
+  }
+  XFreeGC(display, colorGCs[RED]);
+  XFreeGC(display, colorGCs[GRAY]);
+  XFreeGC(display, backgroundGC);
+  XCloseDisplay(display);
+
+  for (int i = 0; i < 2; i++) {
+    free(segmentBuffers[i].segments[RED]);
+    free(segmentBuffers[i].segments[GRAY]);
+  }
+  free(segmentSlots);
+}
+
+void graphicMain(int argc, char *argv[], LineDemo *lineDemo, bool imageOnlyFlag,
+                 bool doubleBufferFlag, bool pipelineFlag) {
   gLineDemo = lineDemo;
+  doubleBuffer = doubleBufferFlag;
 
   // Initialization
   graphicInit(&argc, argv);
 
   // Entering the rendering loop
-  graphicMainLoop(imageOnlyFlag);
-
-  if (segments != NULL) {
-    free(segments);
+  if (pipelineFlag && !imageOnlyFlag) {
+    graphicPipelinedLoop();
+  } else {
+    graphicMainLoop(imageOnlyFlag);
   }
+
+  graphicCleanup();
 }
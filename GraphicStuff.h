@@ -29,7 +29,11 @@
 
 struct LineDemo;
 
+// Runs the simulation in an X window.  With doubleBufferFlag, each frame is
+// drawn into an (MIT-SHM, if available) pixmap and copied to the window.
+// With pipelineFlag, each frame is drawn on a separate thread while the
+// next one is simulated.
 void graphicMain(int argc, char *argv[], struct LineDemo *lineDemo,
-                 bool imageOnlyFlag);
+                 bool imageOnlyFlag, bool doubleBufferFlag, bool pipelineFlag);
 
 #endif  // GRAPHICSTUFF_H_
@@ -30,6 +30,29 @@
 #define MIN(a,b) ((a<b)?a:b)
 #define MAX(a,b) ((a>b)?a:b)
 
+// Sine of the angle below which atan2 may not order two directions
+#define PARALLEL_TOLERANCE 2e-15
+
+/////////////////////////////////////////////////////////////////////////////////
+// Sign of Vec_angle(v1, v2) without the atan2 calls.  Arguments lie in
+// (-pi, pi], so vectors below the x axis come first, and within a half plane
+// the cross product orders them.  Nearly parallel vectors, whose arguments
+// atan2 may round together, are left to Vec_angle so the sign is the same.
+static inline int compareArguments(Vec v1, Vec v2) {
+  double cross = crossProduct(v2.x, v2.y, v1.x, v1.y);
+  if (cross * cross <= PARALLEL_TOLERANCE * PARALLEL_TOLERANCE
+                       * Vec_dotProduct(v1, v1) * Vec_dotProduct(v2, v2)) {
+    double angle = Vec_angle(v1, v2);
+    return (angle > 0) - (angle < 0);
+  }
+  bool lower1 = v1.y < 0;
+  bool lower2 = v2.y < 0;
+  if (lower1 != lower2) {
+    return lower1 ? -1 : 1;
+  }
+  return cross > 0 ? 1 : -1;
+}
+
 /////////////////////////////////////////////////////////////////////////////////
 // Detect if lines l1 and l2 will intersect between now and the next time step.
 // Return the intersection type of the intersection if there is one, or
@@ -75,15 +98,13 @@ inline IntersectionType intersect(Line *l1, Line *l2, Vec p1, Vec p2) {
     bottom_intersected = true;
   }
 
-  // Calculate angle to determine type of intersection.
-  Vec v1 = Vec_makeFromLine(*l1);
-  Vec v2 = Vec_makeFromLine(*l2);
-  double angle = Vec_angle(v1, v2);
-
   if (num_line_intersections == 2) {
     return L2_WITH_L1;
   }
-  
+
+  // Sign of the angle between the lines determines the type of intersection.
+  int angle = compareArguments(l1->direction, l2->direction);
+
   if (top_intersected && angle < 0){
     return L2_WITH_L1;
   }
@@ -106,13 +127,13 @@ inline IntersectionType intersect(Line *l1, Line *l2, Vec p1, Vec p2) {
 // p2 -> The location of the second line's second point after the next timestamp
 inline IntersectionType fastIntersect(Line *l1, Line *l2, Vec p1, Vec p2) {
   assert(compareLines(l1, l2) < 0);
-  
-  // Variables to avoid looking up p1 and p2 for lines 1 and 2 each time.
-  Vec l1p1 = l1->p1;
-  Vec l1p2 = l1->p2;
-  Vec l2p1 = l2->p1;
-  Vec l2p2 = l2->p2;
+  return fastIntersectPoints(l1->p1, l1->p2, l2->p1, l2->p2, p1, p2);
+}
 
+/////////////////////////////////////////////////////////////////////////////////
+// fastIntersect on endpoints alone, for callers that keep copies of them.
+inline bool fastIntersectPoints(Vec l1p1, Vec l1p2, Vec l2p1, Vec l2p2,
+                                Vec p1, Vec p2) {
   // Bounding box: check if one line is entirely to one side or the other
   // of the parallelogram created by the movement of line 2 relative to line 1.
   if (MAX(l1p1.x,l1p2.x) < MIN(MIN(l2p1.x,l2p2.x),MIN(p1.x,p2.x))) {
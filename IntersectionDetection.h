@@ -39,6 +39,10 @@ IntersectionType intersect(Line *l1, Line *l2, Vec p1, Vec p2);
 
 IntersectionType fastIntersect(Line *l1, Line *l2, Vec p1, Vec p2);
 
+// fastIntersect given the endpoints of l1 (l1p1, l1p2) and l2 (l2p1, l2p2).
+bool fastIntersectPoints(Vec l1p1, Vec l1p2, Vec l2p1, Vec l2p2,
+                         Vec p1, Vec p2);
+
 // Check if a point is in the parallelogram.
 bool pointInParallelogram(Vec point, Vec p1, Vec p2, Vec p3, Vec p4);
 
@@ -133,19 +133,33 @@ void merge_lists(IntersectionEventList* list1, IntersectionEventList* list2) {
   }
 }
 
-// Evaluates *left = *left OPERATOR *right.
-void intersection_event_list_reduce(void* key, void* left, void* right){
-  merge_lists((IntersectionEventList *)left,(IntersectionEventList *)right);
-};
+void IntersectionEventListReducer_init(
+    IntersectionEventListReducer* intersectionEventListReducer) {
+  const int numViews = Parallel_numWorkers();
+  if (posix_memalign((void**) &intersectionEventListReducer->views,
+                     PARALLEL_CACHE_LINE,
+                     numViews * sizeof(IntersectionEventListView)) != 0) {
+    abort();
+  }
+  for (int i = 0; i < numViews; i++) {
+    intersectionEventListReducer->views[i].list = IntersectionEventList_make();
+  }
+}
 
-// Sets *value to the the identity value.
-void intersection_event_list_identity(void* key, void* value){
-  IntersectionEventList *old_list = (IntersectionEventList *)value;
-  old_list->head = NULL;
-  old_list->tail = NULL;
-};
+void IntersectionEventListReducer_destroy(
+    IntersectionEventListReducer* intersectionEventListReducer) {
+  for (int i = 0; i < Parallel_numWorkers(); i++) {
+    IntersectionEventList_deleteNodes(&intersectionEventListReducer->views[i].list);
+  }
+  free(intersectionEventListReducer->views);
+  intersectionEventListReducer->views = NULL;
+}
 
-// Destroys any dynamically allocated memory. Hint: delete_nodes.
-void intersection_event_list_destroy(void* key, void* value){
-  IntersectionEventList_deleteNodes((IntersectionEventList *)value);
-};
+IntersectionEventList IntersectionEventListReducer_reduce(
+    IntersectionEventListReducer* intersectionEventListReducer) {
+  IntersectionEventList intersectionEventList = IntersectionEventList_make();
+  for (int i = 0; i < Parallel_numWorkers(); i++) {
+    merge_lists(&intersectionEventList, &intersectionEventListReducer->views[i].list);
+  }
+  return intersectionEventList;
+}
@@ -25,8 +25,7 @@
 
 #include "Line.h"
 #include "IntersectionDetection.h"
-
-#include <cilk/reducer.h>
+#include "Parallel.h"
 
 struct IntersectionEventNode {
   // This IntersectionEventNode does not own these Line* lines.
@@ -54,7 +53,14 @@ struct IntersectionEventList {
 };
 typedef struct IntersectionEventList IntersectionEventList;
 
-typedef CILK_C_DECLARE_REDUCER(IntersectionEventList) IntersectionEventListReducer;
+typedef struct IntersectionEventListView {
+  IntersectionEventList list;
+} __attribute__((aligned(PARALLEL_CACHE_LINE))) IntersectionEventListView;
+
+// One list per worker, concatenated once the parallel work is done.
+typedef struct IntersectionEventListReducer {
+  IntersectionEventListView* views;
+} IntersectionEventListReducer;
 
 // Returns an empty list.
 IntersectionEventList IntersectionEventList_make();
@@ -76,10 +82,23 @@ void IntersectionEventList_deleteNodes(
 // Concatenates two intersection event lists
 void merge_lists(IntersectionEventList* list1, IntersectionEventList* list2);
 
-void intersection_event_list_reduce(void* key, void* left, void* right);
+// Starts every worker's list empty.
+void IntersectionEventListReducer_init(
+    IntersectionEventListReducer* intersectionEventListReducer);
+
+// Deletes the nodes still in the workers' lists.
+void IntersectionEventListReducer_destroy(
+    IntersectionEventListReducer* intersectionEventListReducer);
 
-void intersection_event_list_identity(void* key, void* value);
+// The calling worker's list.
+static inline IntersectionEventList* IntersectionEventListReducer_view(
+    IntersectionEventListReducer* intersectionEventListReducer) {
+  return &intersectionEventListReducer->views[Parallel_workerNumber()].list;
+}
 
-void intersection_event_list_destroy(void* key, void* value);
+// Concatenates the workers' lists, leaving them empty.  Call only outside
+// parallel loops.
+IntersectionEventList IntersectionEventListReducer_reduce(
+    IntersectionEventListReducer* intersectionEventListReducer);
 
 #endif  // INTERSECTIONEVENTLIST_H_
@@ -24,7 +24,8 @@
 #ifndef LINE_H_
 #define LINE_H_
 
-#include "GraphicStuff.h"
+#include <stdint.h>
+
 #include "Vec.h"
 
 // Lines' coordinates are stored in a box with these bounds
@@ -66,12 +67,30 @@ struct Line {
   
   vec_dimension length;
 
+  // Derived from the above by updateParallelogram, once per time step.
+  Vec sweptMin;  // Bounding box of the parallelogram p1, p2, p4, p3.
+  Vec sweptMax;
+  Vec direction;  // Vec_makeFromLine(line), p1 - p2.
+  vec_dimension inverseLength;  // 1 / |direction|, to normalize it.
+  Vec face;  // direction * inverseLength, the line's collision face.
+
+  // Leaves of the quadtree the parallelogram overlaps, bit k for the leaf
+  // with Morton code k.  Only meaningful while the collision world's
+  // leafMasksValid is set.
+  uint64_t leafMask;
+
   Color color;  // The line's color.
 
   unsigned int id;  // Unique line ID.
 };
 typedef struct Line Line;
 
+// Returns a vector parallel to the provided Line.  The direction of the
+// vector is unspecified.
+static inline Vec Vec_makeFromLine(const Line* line) {
+  return Vec_subtract(line->p1, line->p2);
+}
+
 // Compares the lines by line ID.
 // -1 <=> line1 ordered before line2
 //  0 <=> line1 ordered the same as line2
@@ -107,10 +126,36 @@ static inline void velocityWindowToBox(box_dimension *xout, box_dimension *yout,
   *yout = y / WINDOW_HEIGHT * ((double) BOX_YMAX - BOX_YMIN);
 }
 
+// Convert box velocity to graphical window velocity.
+static inline void velocityBoxToWindow(window_dimension *xout,
+                                       window_dimension *yout,
+                                       box_dimension x, box_dimension y) {
+  *xout = x / ((double) BOX_XMAX - BOX_XMIN) * WINDOW_WIDTH;
+  *yout = y / ((double) BOX_YMAX - BOX_YMIN) * WINDOW_HEIGHT;
+}
+
+// Recompute the parallelogram the line sweeps in the next time step, and
+// the values derived from its position that the collision code shares.
 static inline void updateParallelogram(Line *line, double timeStep){
   line->shift = Vec_multiply(line->velocity, timeStep);
   line->p3 = Vec_add(line->p1, line->shift);
   line->p4 = Vec_add(line->p2, line->shift);
+
+  // The corners are p1, p2 and the same shifted.  Adding the shift to the
+  // smaller endpoint gives exactly the smaller shifted endpoint.
+  Vec low = Vec_make(line->p1.x < line->p2.x ? line->p1.x : line->p2.x,
+                     line->p1.y < line->p2.y ? line->p1.y : line->p2.y);
+  Vec high = Vec_make(line->p1.x > line->p2.x ? line->p1.x : line->p2.x,
+                      line->p1.y > line->p2.y ? line->p1.y : line->p2.y);
+  line->sweptMin.x = line->shift.x < 0 ? low.x + line->shift.x : low.x;
+  line->sweptMin.y = line->shift.y < 0 ? low.y + line->shift.y : low.y;
+  line->sweptMax.x = line->shift.x > 0 ? high.x + line->shift.x : high.x;
+  line->sweptMax.y = line->shift.y > 0 ? high.y + line->shift.y : high.y;
+
+  line->direction = Vec_makeFromLine(line);
+  line->inverseLength = 1 / sqrt(Vec_dotProduct(line->direction,
+                                                line->direction));
+  line->face = Vec_multiply(line->direction, line->inverseLength);
 }
 
 
@@ -28,7 +28,7 @@
 #include <assert.h>
 #include <stdio.h>
 
-#include "GraphicStuff.h"
+#include "fasttime.h"
 #include "Line.h"
 
 LineDemo* LineDemo_new() {
@@ -40,16 +40,38 @@ LineDemo* LineDemo_new() {
   lineDemo->count = 0;
   lineDemo->numFrames = 0;
   lineDemo->collisionWorld = NULL;
+  lineDemo->checkpoint = NULL;
+  lineDemo->trajectoryWriter = NULL;
+  lineDemo->maxStepFrames = 1;
+  lineDemo->autotuner = NULL;
+  lineDemo->statsFile = NULL;
+  lineDemo->statsInterval = 0;
   return lineDemo;
 }
 
 void LineDemo_delete(LineDemo* lineDemo) {
+  if (lineDemo->checkpoint != NULL) {
+    Checkpoint_delete(lineDemo->checkpoint);
+  }
+  if (lineDemo->trajectoryWriter != NULL) {
+    TrajectoryWriter_delete(lineDemo->trajectoryWriter);
+  }
+  if (lineDemo->autotuner != NULL) {
+    Autotuner_delete(lineDemo->autotuner);
+  }
   CollisionWorld_delete(lineDemo->collisionWorld);
   free(lineDemo);
 }
 
 // Read in lines from line.in and add them into collision world for simulation.
 void LineDemo_createLines(LineDemo* lineDemo) {
+  if (!LineDemo_createLinesFromFile(lineDemo, "line.in")) {
+    exit(1);
+  }
+}
+
+// Read in lines from path and add them into collision world for simulation.
+bool LineDemo_createLinesFromFile(LineDemo* lineDemo, const char* path) {
   unsigned int lineId = 0;
   unsigned int numOfLines;
   window_dimension px1;
@@ -60,10 +82,17 @@ void LineDemo_createLines(LineDemo* lineDemo) {
   window_dimension vy;
   int isGray;
   FILE *fin;
-  fin = fopen("line.in", "r");
-  assert(fin != NULL);
+  fin = fopen(path, "r");
+  if (fin == NULL) {
+    perror(path);
+    return false;
+  }
 
-  fscanf(fin, "%d\n", &numOfLines);
+  if (fscanf(fin, "%d\n", &numOfLines) != 1 || numOfLines == 0) {
+    fprintf(stderr, "%s: expected the number of lines\n", path);
+    fclose(fin);
+    return false;
+  }
   lineDemo->collisionWorld = CollisionWorld_new(numOfLines);
 
   while (EOF
@@ -89,6 +118,47 @@ void LineDemo_createLines(LineDemo* lineDemo) {
     CollisionWorld_addLine(lineDemo->collisionWorld, line);
   }
   fclose(fin);
+  return true;
+}
+
+bool LineDemo_restore(LineDemo* lineDemo, const char* path) {
+  lineDemo->collisionWorld = Checkpoint_restore(path, &lineDemo->count);
+  return lineDemo->collisionWorld != NULL;
+}
+
+void LineDemo_setCheckpoint(LineDemo* lineDemo, Checkpoint* checkpoint) {
+  lineDemo->checkpoint = checkpoint;
+}
+
+void LineDemo_setTrajectoryWriter(LineDemo* lineDemo,
+                                  TrajectoryWriter* trajectoryWriter) {
+  lineDemo->trajectoryWriter = trajectoryWriter;
+  CollisionWorld_recordEvents(lineDemo->collisionWorld);
+  TrajectoryWriter_record(trajectoryWriter, lineDemo->collisionWorld,
+                          lineDemo->count);
+}
+
+void LineDemo_setNumaPlacement(LineDemo* lineDemo,
+                               NumaPlacement* numaPlacement) {
+  NumaPlacement_pinWorkers(numaPlacement);
+  NumaPlacement_placeLines(numaPlacement, lineDemo->collisionWorld);
+}
+
+void LineDemo_setAutotuner(LineDemo* lineDemo, Autotuner* autotuner) {
+  lineDemo->autotuner = autotuner;
+}
+
+void LineDemo_setMaxStepFrames(LineDemo* lineDemo,
+                               unsigned int maxStepFrames) {
+  lineDemo->maxStepFrames = maxStepFrames;
+}
+
+void LineDemo_setStatsDump(LineDemo* lineDemo, FILE* out,
+                           unsigned int interval) {
+  assert(interval > 0);
+  lineDemo->statsFile = out;
+  lineDemo->statsInterval = interval;
+  CollisionWorld_recordStats(lineDemo->collisionWorld);
 }
 
 void LineDemo_setNumFrames(LineDemo* lineDemo, const unsigned int numFrames) {
@@ -115,10 +185,75 @@ unsigned int LineDemo_getNumLineLineCollisions(LineDemo* lineDemo) {
   return CollisionWorld_getNumLineLineCollisions(lineDemo->collisionWorld);
 }
 
+// Frames from count to the next multiple of interval
+static inline unsigned int framesUntil(unsigned int count,
+                                       unsigned int interval) {
+  return interval - count % interval;
+}
+
+// The most frames the next update may cover
+static unsigned int maxFramesOf(LineDemo* lineDemo) {
+  if (lineDemo->trajectoryWriter != NULL) {
+    return 1;
+  }
+  unsigned int maxFrames = MIN(lineDemo->maxStepFrames,
+                               lineDemo->numFrames + 1 - lineDemo->count);
+  maxFrames = MIN(maxFrames, framesUntil(lineDemo->count,
+                                         LINE_REORDER_INTERVAL));
+  if (lineDemo->collisionWorld->numaPlacement != NULL) {
+    maxFrames = MIN(maxFrames, framesUntil(lineDemo->count,
+                                           NUMA_PLACE_INTERVAL));
+  }
+  if (lineDemo->checkpoint != NULL && lineDemo->checkpoint->interval > 0) {
+    maxFrames = MIN(maxFrames, framesUntil(lineDemo->count,
+                                           lineDemo->checkpoint->interval));
+  }
+  return maxFrames;
+}
+
 // The main simulation loop
 bool LineDemo_update(LineDemo* lineDemo) {
-  lineDemo->count++;
-  CollisionWorld_updateLines(lineDemo->collisionWorld);
+  // a run resumed from a snapshot may already be done
+  if (lineDemo->count > lineDemo->numFrames) {
+    return false;
+  }
+  const fasttime_t start = gettime();
+  unsigned int frames = 1;
+  if (lineDemo->maxStepFrames > 1) {
+    frames = CollisionWorld_updateLinesAdaptive(lineDemo->collisionWorld,
+                                                maxFramesOf(lineDemo));
+  } else {
+    CollisionWorld_updateLines(lineDemo->collisionWorld);
+  }
+  lineDemo->count += frames;
+  if (lineDemo->autotuner != NULL) {
+    Autotuner_recordFrame(lineDemo->autotuner, lineDemo->collisionWorld,
+                          tdiff(start, gettime()) / frames, lineDemo->count);
+  }
+  // a step of several frames may pass over a multiple of the interval
+  if (lineDemo->statsFile != NULL
+      && lineDemo->count / lineDemo->statsInterval
+         != (lineDemo->count - frames) / lineDemo->statsInterval) {
+    Quadtree_printStats(lineDemo->statsFile, lineDemo->collisionWorld->stats,
+                        lineDemo->count);
+  }
+  NumaPlacement* numaPlacement = lineDemo->collisionWorld->numaPlacement;
+  if (lineDemo->count % LINE_REORDER_INTERVAL == 0) {
+    // places the lines by NUMA node as well
+    CollisionWorld_reorderLines(lineDemo->collisionWorld);
+  } else if (numaPlacement != NULL
+             && lineDemo->count % NUMA_PLACE_INTERVAL == 0) {
+    NumaPlacement_placeLines(numaPlacement, lineDemo->collisionWorld);
+  }
+  if (lineDemo->trajectoryWriter != NULL) {
+    TrajectoryWriter_record(lineDemo->trajectoryWriter,
+                            lineDemo->collisionWorld, lineDemo->count);
+  }
+  if (lineDemo->checkpoint != NULL && lineDemo->checkpoint->interval > 0
+      && lineDemo->count % lineDemo->checkpoint->interval == 0) {
+    Checkpoint_save(lineDemo->checkpoint, lineDemo->collisionWorld,
+                    lineDemo->count);
+  }
   if (lineDemo->count > lineDemo->numFrames) {
     return false;
   }
@@ -25,7 +25,11 @@
 #define LINEDEMO_H_
 
 #include "Line.h"
+#include "Autotune.h"
 #include "CollisionWorld.h"
+#include "Checkpoint.h"
+#include "Numa.h"
+#include "TrajectoryWriter.h"
 
 struct LineDemo {
   // Iteration counter
@@ -36,6 +40,27 @@ struct LineDemo {
 
   // Objects for line simulation
   CollisionWorld* collisionWorld;
+
+  // Periodic snapshots of the collision world, or NULL.
+  // This LineDemo owns the Checkpoint.
+  Checkpoint* checkpoint;
+
+  // Per-frame trajectory and event recording, or NULL.
+  // This LineDemo owns the TrajectoryWriter.
+  TrajectoryWriter* trajectoryWriter;
+
+  // Most frames one update may cover while nothing collides, 1 for a fixed
+  // time step
+  unsigned int maxStepFrames;
+
+  // Tunes the collision world's quadtree and grain size, or NULL.
+  // This LineDemo owns the Autotuner.
+  Autotuner* autotuner;
+
+  // Where the quadtree stats are printed every statsInterval frames, or
+  // NULL
+  FILE* statsFile;
+  unsigned int statsInterval;
 };
 typedef struct LineDemo LineDemo;
 
@@ -45,6 +70,45 @@ void LineDemo_delete(LineDemo* lineDemo);
 // Add lines for line simulation at beginning.
 void LineDemo_createLines(LineDemo* lineDemo);
 
+// Add lines from the given file instead of line.in.  Returns false if the
+// file cannot be read.
+bool LineDemo_createLinesFromFile(LineDemo* lineDemo, const char* path);
+
+// Continue the line simulation from the snapshot at path instead of line.in.
+// Returns false if the snapshot could not be loaded.
+bool LineDemo_restore(LineDemo* lineDemo, const char* path);
+
+// Write a snapshot to path every interval frames.
+// This LineDemo becomes owner of the Checkpoint.
+void LineDemo_setCheckpoint(LineDemo* lineDemo, Checkpoint* checkpoint);
+
+// Record positions and collision events every frame, starting with the
+// current one.  This LineDemo becomes owner of the TrajectoryWriter.
+void LineDemo_setTrajectoryWriter(LineDemo* lineDemo,
+                                  TrajectoryWriter* trajectoryWriter);
+
+// Pin the workers and place the lines by NUMA node, now and every
+// NUMA_PLACE_INTERVAL frames.  The collision world becomes owner of the
+// NumaPlacement.
+void LineDemo_setNumaPlacement(LineDemo* lineDemo,
+                               NumaPlacement* numaPlacement);
+
+// Time every frame and let the autotuner pick the configuration of the
+// next.  This LineDemo becomes owner of the Autotuner.
+void LineDemo_setAutotuner(LineDemo* lineDemo, Autotuner* autotuner);
+
+// Let an update cover up to maxStepFrames frames at once while no
+// collision can happen (see CollisionWorld_updateLinesAdaptive).  Updates
+// still end on every frame a snapshot, reordering or NUMA placement is due,
+// and on the last frame.  Ignored while a trajectory is recorded, since
+// that records every frame.
+void LineDemo_setMaxStepFrames(LineDemo* lineDemo, unsigned int maxStepFrames);
+
+// Keep the quadtree's stats and print those of the last detection to out
+// every interval frames (see QuadtreeStats).
+void LineDemo_setStatsDump(LineDemo* lineDemo, FILE* out,
+                           unsigned int interval);
+
 // Set number of frames to compute.
 void LineDemo_setNumFrames(LineDemo* lineDemo, const unsigned int numFrames);
 
@@ -63,7 +127,8 @@ unsigned int LineDemo_getNumLineWallCollisions(LineDemo* lineDemo);
 // Get number of line-line collisions.
 unsigned int LineDemo_getNumLineLineCollisions(LineDemo* lineDemo);
 
-// Line simulation update function.
+// Line simulation update function.  Returns false once the frame count has
+// passed numFrames; a call made after that simulates nothing.
 bool LineDemo_update(LineDemo* lineDemo);
 
 #endif  // LINEDEMO_H_
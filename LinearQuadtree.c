@@ -0,0 +1,251 @@
+/**
+ * LinearQuadtree.c -- fill the quadtree's leaves by Morton code
+ *
+ * Function definitions in LinearQuadtree.h
+ **/
+
+#include "LinearQuadtree.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "Arena.h"
+#include "CollisionWorld.h"
+#include "Line.h"
+#include "Parallel.h"
+
+// Cells of the deepest tree a collision world may ask for
+#define MAX_CELLS (1 << (2 * QUADTREE_MAX_DEPTH))
+
+// Cells per line a block's code cache starts with room for
+#define BLOCK_CODES_PER_LINE 4
+
+// Interleave the bits of the cell coordinates, x in the even bits.
+static inline unsigned int mortonCode(unsigned int x, unsigned int y,
+                                      unsigned int depth) {
+  unsigned int code = 0;
+  for (int bit = 0; bit < depth; bit++) {
+    code |= ((x >> bit) & 1) << (2 * bit);
+    code |= ((y >> bit) & 1) << (2 * bit + 1);
+  }
+  return code;
+}
+
+// The even bits of a code, packed together: the cell column.
+static inline unsigned int evenBits(unsigned int code, unsigned int depth) {
+  unsigned int bits = 0;
+  for (int bit = 0; bit < depth; bit++) {
+    bits |= ((code >> (2 * bit)) & 1) << bit;
+  }
+  return bits;
+}
+
+// Cell column or row of a coordinate, clamped to one cell past the box.
+static inline int cellOf(double offset, double cellSize, int cellsPerSide) {
+  double cell = floor(offset / cellSize);
+  if (!(cell >= -1)) {
+    return -1;
+  }
+  if (cell >= cellsPerSide) {
+    return cellsPerSide;
+  }
+  return (int) cell;
+}
+
+typedef struct BuildContext {
+  Quadtree* root;
+
+  // The leaves of the pool, indexed by Morton code
+  Quadtree* leaves;
+  int cellsPerSide;
+  unsigned int numCells;
+
+  // The square of cells below the node being built, and their codes
+  int firstX;
+  int firstY;
+  int lastX;
+  int lastY;
+  unsigned int codeBegin;
+  unsigned int codeEnd;
+
+  // Take each line's cells from its leafMask
+  bool useMasks;
+
+  // Number of lines of each block in each cell, then where the block's
+  // lines of each cell go in sorted
+  unsigned int* blockCounts;
+
+  // The cells the count pass found for each line, so the scatter pass need
+  // not find them again: numCodes[i] codes for line i, the codes of a
+  // block's lines back to back from blockCodes[block]
+  unsigned short* numCodes;
+  unsigned short** blockCodes;
+
+  Line** sorted;
+} BuildContext;
+
+// Set up the context for the leaves below quadtree.
+static void initContext(BuildContext* context, Quadtree* quadtree) {
+  Quadtree* root = quadtree;
+  while (root->parent != NULL) {
+    root = root->parent;
+  }
+
+  // the codes below a node share its path from the root as a prefix
+  const unsigned int levels = root->leafDepth - quadtree->depth;
+  const unsigned int prefix = (quadtree - root) - ((1 << (2 * quadtree->depth)) - 1) / 3;
+  context->codeBegin = prefix << (2 * levels);
+  context->codeEnd = (prefix + 1) << (2 * levels);
+
+  context->root = root;
+  context->cellsPerSide = 1 << root->leafDepth;
+  context->numCells = 1 << (2 * root->leafDepth);
+  context->leaves = root + (context->numCells - 1) / 3;
+  context->firstX = evenBits(context->codeBegin, root->leafDepth);
+  context->firstY = evenBits(context->codeBegin >> 1, root->leafDepth);
+  context->lastX = context->firstX + (1 << levels) - 1;
+  context->lastY = context->firstY + (1 << levels) - 1;
+  context->useMasks = root->collisionWorld->leafMasksValid;
+}
+
+///////////////////////////////////////////////////////////
+// Find the cells a line belongs to, in no particular order.  With valid
+// masks they are the line's leafMask.  Otherwise cells are taken from the
+// parallelogram's bounding box, one cell wider on each side so lines on a
+// cell border are never missed, and then tested exactly.
+static unsigned int cellsOf(BuildContext* context, Line* line,
+                            unsigned int codes[MAX_CELLS]) {
+  unsigned int numCodes = 0;
+  if (context->useMasks) {
+    for (uint64_t mask = line->leafMask; mask != 0; mask &= mask - 1) {
+      unsigned int code = __builtin_ctzll(mask);
+      if (code >= context->codeBegin && code < context->codeEnd) {
+        codes[numCodes++] = code;
+      }
+    }
+    return numCodes;
+  }
+
+  Quadtree* root = context->root;
+  const int cells = context->cellsPerSide;
+  double cellWidth = (root->lowerRight.x - root->upperLeft.x) / cells;
+  double cellHeight = (root->lowerRight.y - root->upperLeft.y) / cells;
+
+  int x0 = MAX(cellOf(line->sweptMin.x - root->upperLeft.x, cellWidth, cells) - 1,
+               context->firstX);
+  int x1 = MIN(cellOf(line->sweptMax.x - root->upperLeft.x, cellWidth, cells) + 1,
+               context->lastX);
+  int y0 = MAX(cellOf(line->sweptMin.y - root->upperLeft.y, cellHeight, cells) - 1,
+               context->firstY);
+  int y1 = MIN(cellOf(line->sweptMax.y - root->upperLeft.y, cellHeight, cells) + 1,
+               context->lastY);
+
+  for (int y = y0; y <= y1; y++) {
+    for (int x = x0; x <= x1; x++) {
+      unsigned int code = mortonCode(x, y, root->leafDepth);
+      if (isLineInQuadtree(&context->leaves[code], line)) {
+        codes[numCodes++] = code;
+      }
+    }
+  }
+  return numCodes;
+}
+
+static void countBlocks(void* context, int begin, int end) {
+  BuildContext* buildContext = (BuildContext*) context;
+  CollisionWorld* collisionWorld = buildContext->root->collisionWorld;
+  const unsigned int numCells = buildContext->numCells;
+  unsigned int codes[MAX_CELLS];
+  for (int block = begin; block < end; block++) {
+    unsigned int* counts = &buildContext->blockCounts[block * numCells];
+    memset(counts, 0, numCells * sizeof(unsigned int));
+    unsigned int last = MIN((block + 1) * LINEAR_BLOCK_LINES,
+                            collisionWorld->numOfLines);
+    unsigned int capacity = BLOCK_CODES_PER_LINE * LINEAR_BLOCK_LINES;
+    unsigned short* cache = Arena_alloc(buildContext->root->arena,
+                                        capacity * sizeof(unsigned short));
+    unsigned int cached = 0;
+    for (unsigned int i = block * LINEAR_BLOCK_LINES; i < last; i++) {
+      unsigned int numCodes = cellsOf(buildContext, collisionWorld->lines[i],
+                                      codes);
+      // a full cache is moved to one twice its size, like a leaf's bucket
+      if (cached + numCodes > capacity) {
+        capacity = MAX(2 * capacity, cached + numCodes);
+        unsigned short* grown = Arena_alloc(buildContext->root->arena,
+                                            capacity * sizeof(unsigned short));
+        memcpy(grown, cache, cached * sizeof(unsigned short));
+        cache = grown;
+      }
+      buildContext->numCodes[i] = numCodes;
+      for (unsigned int k = 0; k < numCodes; k++) {
+        counts[codes[k]]++;
+        cache[cached++] = codes[k];
+      }
+    }
+    buildContext->blockCodes[block] = cache;
+  }
+}
+
+static void scatterBlocks(void* context, int begin, int end) {
+  BuildContext* buildContext = (BuildContext*) context;
+  CollisionWorld* collisionWorld = buildContext->root->collisionWorld;
+  for (int block = begin; block < end; block++) {
+    unsigned int* next = &buildContext->blockCounts[block * buildContext->numCells];
+    const unsigned short* codes = buildContext->blockCodes[block];
+    unsigned int last = MIN((block + 1) * LINEAR_BLOCK_LINES,
+                            collisionWorld->numOfLines);
+    for (unsigned int i = block * LINEAR_BLOCK_LINES; i < last; i++) {
+      Line* line = collisionWorld->lines[i];
+      for (unsigned int k = 0; k < buildContext->numCodes[i]; k++) {
+        buildContext->sorted[next[*codes++]++] = line;
+      }
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////
+// Count the lines of each block in each cell, keeping each line's cells,
+// turn the counts into the blocks' offsets in code-major order, and
+// scatter.  Blocks are in line
+// order and each block writes its lines in order, so the sort is stable.
+void LinearQuadtree_build(Quadtree* quadtree) {
+  BuildContext context;
+  initContext(&context, quadtree);
+  Quadtree* root = context.root;
+  const unsigned int codeBegin = context.codeBegin;
+  const unsigned int codeEnd = context.codeEnd;
+
+  const unsigned int numOfLines = root->collisionWorld->numOfLines;
+  const unsigned int numBlocks =
+      (numOfLines + LINEAR_BLOCK_LINES - 1) / LINEAR_BLOCK_LINES;
+  context.blockCounts = Arena_alloc(root->arena,
+                                    numBlocks * context.numCells * sizeof(unsigned int));
+  context.numCodes = Arena_alloc(root->arena,
+                                 numOfLines * sizeof(unsigned short));
+  context.blockCodes = Arena_alloc(root->arena,
+                                   numBlocks * sizeof(unsigned short*));
+  Parallel_for(0, numBlocks, 1, countBlocks, &context);
+
+  unsigned int total = 0;
+  for (unsigned int code = codeBegin; code < codeEnd; code++) {
+    Quadtree* leaf = &context.leaves[code];
+    unsigned int start = total;
+    for (unsigned int block = 0; block < numBlocks; block++) {
+      unsigned int count = context.blockCounts[block * context.numCells + code];
+      context.blockCounts[block * context.numCells + code] = total;
+      total += count;
+    }
+    leaf->numOfLines = total - start;
+  }
+
+  context.sorted = Arena_alloc(root->arena, total * sizeof(Line*));
+  Parallel_for(0, numBlocks, 1, scatterBlocks, &context);
+
+  total = 0;
+  for (unsigned int code = codeBegin; code < codeEnd; code++) {
+    Quadtree* leaf = &context.leaves[code];
+    leaf->lines = context.sorted + total;
+    leaf->lineCapacity = leaf->numOfLines;
+    total += leaf->numOfLines;
+  }
+}
@@ -0,0 +1,34 @@
+/**
+ * LinearQuadtree.h -- fill the quadtree's leaves by Morton code
+ *
+ * With collisionWorld->linearQuadtree set, the default in a QUADTREE=linear
+ * build (QUADTREE_LINEAR), the leaves are not filled by each leaf scanning
+ * every line.  Instead each line is given the Morton
+ * codes of the leaf cells its parallelogram touches, and one parallel
+ * counting sort of the (code, line) pairs lays all buckets out back to back
+ * in a single array.  A leaf's bucket is then the range of its code, and
+ * internal nodes are the ranges of code prefixes.
+ *
+ * The Morton code of a leaf is its path of quadrants from the root, so in
+ * a tree with leaves at depth d, leaf k is node (4^d - 1) / 3 + k of the
+ * quadtree's node pool.
+ * Lines are tested against the cells with isLineInQuadtree, so the leaves
+ * hold the same lines in the same order as with the pointer quadtree.
+ *
+ * While the lines' leaf masks are valid (see Quadtree_leafMask), the cells
+ * are read from the masks instead of being tested, and Quadtree_update
+ * fills the pointer quadtree this way too.
+ **/
+
+#ifndef LINEARQUADTREE_H_
+#define LINEARQUADTREE_H_
+
+#include "Quadtree.h"
+
+// Lines per block of the counting sort
+#define LINEAR_BLOCK_LINES 512
+
+// Fills every leaf below quadtree, drawing from the tree's arena.
+void LinearQuadtree_build(Quadtree* quadtree);
+
+#endif  // LINEARQUADTREE_H_
@@ -0,0 +1,280 @@
+/**
+ * Numa.c -- place line storage and pin workers by NUMA node
+ *
+ * Function definitions in Numa.h
+ **/
+
+#define _GNU_SOURCE
+
+#include "Numa.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Parallel.h"
+#include "Quadtree.h"
+
+// CPUs of each node this process may run on, read once.
+static cpu_set_t nodeCPUs[NUMA_MAX_NODES];
+static unsigned int numNodes = 0;
+
+// Parse a cpulist such as "0-15,32-47" into a CPU set.
+static bool parseCPUList(const char* path, cpu_set_t* cpus) {
+  FILE* fin = fopen(path, "r");
+  if (fin == NULL) {
+    return false;
+  }
+  CPU_ZERO(cpus);
+  unsigned int first;
+  unsigned int last;
+  int c;
+  while (fscanf(fin, "%u", &first) == 1) {
+    last = first;
+    c = fgetc(fin);
+    if (c == '-') {
+      if (fscanf(fin, "%u", &last) != 1) {
+        break;
+      }
+      c = fgetc(fin);
+    }
+    for (unsigned int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, cpus);
+    }
+    if (c != ',') {
+      break;
+    }
+  }
+  fclose(fin);
+  return true;
+}
+
+static void readTopology() {
+  if (numNodes > 0) {
+    return;
+  }
+  cpu_set_t allowed;
+  sched_getaffinity(0, sizeof(cpu_set_t), &allowed);
+
+  char path[64];
+  for (unsigned int node = 0; node < NUMA_MAX_NODES; node++) {
+    cpu_set_t cpus;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist",
+             node);
+    if (!parseCPUList(path, &cpus)) {
+      continue;
+    }
+    CPU_AND(&cpus, &cpus, &allowed);
+    if (CPU_COUNT(&cpus) > 0) {
+      nodeCPUs[numNodes++] = cpus;
+    }
+  }
+  if (numNodes == 0) {
+    nodeCPUs[0] = allowed;
+    numNodes = 1;
+  }
+}
+
+NumaPlacement* NumaPlacement_new() {
+  NumaPlacement* numaPlacement = malloc(sizeof(NumaPlacement));
+  if (numaPlacement == NULL) {
+    return NULL;
+  }
+  readTopology();
+  numaPlacement->numNodes = numNodes;
+  for (int node = 0; node < NUMA_MAX_NODES; node++) {
+    numaPlacement->slabs[node] = NULL;
+    numaPlacement->slabSizes[node] = 0;
+  }
+  return numaPlacement;
+}
+
+static void freeSlabs(Line* slabs[], size_t slabSizes[]) {
+  for (int node = 0; node < NUMA_MAX_NODES; node++) {
+    if (slabs[node] != NULL) {
+      munmap(slabs[node], slabSizes[node]);
+    }
+  }
+}
+
+void NumaPlacement_delete(NumaPlacement* numaPlacement) {
+  freeSlabs(numaPlacement->slabs, numaPlacement->slabSizes);
+  free(numaPlacement);
+}
+
+#if !defined(PARALLEL_OPENMP)
+typedef struct PinContext {
+  NumaPlacement* numaPlacement;
+  int numWorkers;
+  bool* pinned;
+} PinContext;
+
+static void pinWorker(void* context, int worker) {
+  PinContext* pinContext = (PinContext*) context;
+  unsigned int node = worker * pinContext->numaPlacement->numNodes
+      / pinContext->numWorkers;
+  pinContext->pinned[worker] =
+      pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                             &nodeCPUs[node]) == 0;
+}
+#endif
+
+///////////////////////////////////////////////////////////
+// Each worker pins itself on its own thread, through the backend's worker
+// hook.  OpenMP places its threads itself, so there this only checks that
+// it was asked to.
+void NumaPlacement_pinWorkers(NumaPlacement* numaPlacement) {
+#if defined(PARALLEL_OPENMP)
+  if (omp_get_proc_bind() == omp_proc_bind_false) {
+    fprintf(stderr, "Numa: OpenMP workers are not pinned; "
+            "set OMP_PROC_BIND=close and OMP_PLACES=cores\n");
+  }
+#else
+  const int numWorkers = Parallel_numWorkers();
+  PinContext context = { numaPlacement, numWorkers,
+                         calloc(numWorkers, sizeof(bool)) };
+  if (!Parallel_onEachWorker(pinWorker, &context)) {
+    fprintf(stderr, "Numa: this parallel backend cannot pin its workers\n");
+  } else {
+    for (int worker = 0; worker < numWorkers; worker++) {
+      if (!context.pinned[worker]) {
+        fprintf(stderr, "Numa: could not pin worker %d\n", worker);
+      }
+    }
+  }
+  free(context.pinned);
+#endif
+}
+
+// The region of the box a line belongs to: the leaf its midpoint lies in,
+// numbered by quadrants from the root.
+static unsigned int regionOf(Quadtree* quadtree, Line* line) {
+  Vec midpoint = Vec_divide(Vec_add(line->p1, line->p2), 2);
+  unsigned int region = 0;
+  while (!quadtree->isLeaf) {
+    Vec center = quadtree->quadrants[3]->upperLeft;
+    unsigned int quadrant = (midpoint.x >= center.x) + 2 * (midpoint.y >= center.y);
+    region = 4 * region + quadrant;
+    quadtree = quadtree->quadrants[quadrant];
+  }
+  return region;
+}
+
+// The work of one node's placement thread.
+typedef struct PlacementJob {
+  CollisionWorld* collisionWorld;
+  unsigned int node;
+
+  // Indices into collisionWorld->lines of the lines to place.
+  unsigned int* indices;
+  unsigned int numOfLines;
+
+  Line* slab;
+  size_t slabSize;
+} PlacementJob;
+
+static void* placementMain(void* arg) {
+  PlacementJob* job = (PlacementJob*) arg;
+  Line** lines = job->collisionWorld->lines;
+
+  // the pages are untouched until this thread writes them
+  job->slab = NULL;
+  if (job->slabSize > 0) {
+    job->slab = mmap(NULL, job->slabSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(job->slab != MAP_FAILED);
+  }
+  for (int i = 0; i < job->numOfLines; i++) {
+    Line* line = &job->slab[i];
+    *line = *lines[job->indices[i]];
+    lines[job->indices[i]] = line;
+  }
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////
+// Place every line on the node owning its region, one thread per node.
+void NumaPlacement_placeLines(NumaPlacement* numaPlacement,
+                              CollisionWorld* collisionWorld) {
+  const unsigned int nodes = numaPlacement->numNodes;
+  const unsigned int numOfLines = collisionWorld->numOfLines;
+
+  PlacementJob jobs[NUMA_MAX_NODES];
+  unsigned int* indices = malloc(numOfLines * sizeof(unsigned int));
+  unsigned int* nodeOfLine = malloc(numOfLines * sizeof(unsigned int));
+  for (int node = 0; node < nodes; node++) {
+    jobs[node].collisionWorld = collisionWorld;
+    jobs[node].node = node;
+    jobs[node].numOfLines = 0;
+  }
+  // one region per leaf of the quadtree
+  const unsigned int numRegions = 1 << (2 * collisionWorld->quadtree->leafDepth);
+  for (int i = 0; i < numOfLines; i++) {
+    unsigned int region = regionOf(collisionWorld->quadtree,
+                                   collisionWorld->lines[i]);
+    nodeOfLine[i] = region * nodes / numRegions;
+    jobs[nodeOfLine[i]].numOfLines++;
+  }
+
+  // bucket the line indices by node
+  unsigned int offset = 0;
+  for (int node = 0; node < nodes; node++) {
+    jobs[node].indices = &indices[offset];
+    jobs[node].slabSize = (jobs[node].numOfLines * sizeof(Line)
+                           + getpagesize() - 1) & ~(size_t) (getpagesize() - 1);
+    offset += jobs[node].numOfLines;
+    jobs[node].numOfLines = 0;
+  }
+  for (int i = 0; i < numOfLines; i++) {
+    PlacementJob* job = &jobs[nodeOfLine[i]];
+    job->indices[job->numOfLines++] = i;
+  }
+
+  // Individually allocated lines, or the block of reordered lines, are
+  // freed after they are copied; lines already in slabs go with their slabs.
+  bool placed = collisionWorld->numaPlacement != NULL;
+  Line** oldLines = NULL;
+  if (!placed) {
+    oldLines = malloc(numOfLines * sizeof(Line*));
+    memcpy(oldLines, collisionWorld->lines, numOfLines * sizeof(Line*));
+  }
+
+  pthread_t threads[NUMA_MAX_NODES];
+  for (int node = 0; node < nodes; node++) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &nodeCPUs[node]);
+    pthread_create(&threads[node], &attr, placementMain, &jobs[node]);
+    pthread_attr_destroy(&attr);
+  }
+  for (int node = 0; node < nodes; node++) {
+    pthread_join(threads[node], NULL);
+  }
+
+  if (placed) {
+    freeSlabs(numaPlacement->slabs, numaPlacement->slabSizes);
+  } else {
+    if (collisionWorld->lineStorage != NULL) {
+      free(collisionWorld->lineStorage);
+      collisionWorld->lineStorage = NULL;
+    } else {
+      for (int i = 0; i < numOfLines; i++) {
+        free(oldLines[i]);
+      }
+    }
+    free(oldLines);
+    collisionWorld->numaPlacement = numaPlacement;
+  }
+  for (int node = 0; node < nodes; node++) {
+    numaPlacement->slabs[node] = jobs[node].slab;
+    numaPlacement->slabSizes[node] = jobs[node].slabSize;
+  }
+
+  free(indices);
+  free(nodeOfLine);
+}
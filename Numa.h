@@ -0,0 +1,54 @@
+/**
+ * Numa.h -- place line storage and pin workers by NUMA node
+ *
+ * The 16 leaves of the quadtree, taken in quadrant order, are dealt out to
+ * the NUMA nodes in contiguous blocks, so each node gets a compact region
+ * of the box.  Each line is copied into the slab of the node owning the
+ * leaf its midpoint lies in.  Slabs are written by a thread running on
+ * their node, so their pages are first touched there.  Workers are pinned
+ * to the nodes in blocks of worker numbers; under OpenMP, the runtime pins
+ * them when run with OMP_PROC_BIND=close OMP_PLACES=cores.  Leaf buckets live in the
+ * quadtree's per-frame arena and are not placed.
+ *
+ * Lines move, so LineDemo places them again every NUMA_PLACE_INTERVAL
+ * frames.  Without /sys/devices/system/node the machine is treated as one
+ * node, and placement just packs the lines into one slab.
+ **/
+
+#ifndef NUMA_H_
+#define NUMA_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "CollisionWorld.h"
+#include "Line.h"
+
+#define NUMA_MAX_NODES 64
+#define NUMA_PLACE_INTERVAL 256
+
+typedef struct NumaPlacement {
+  unsigned int numNodes;
+
+  // The slab each node's lines live in, or NULL before the first placement.
+  Line* slabs[NUMA_MAX_NODES];
+  size_t slabSizes[NUMA_MAX_NODES];
+} NumaPlacement;
+
+// Reads the machine's NUMA topology.
+NumaPlacement* NumaPlacement_new();
+
+// Deallocates the slabs, and with them the lines placed in them.
+void NumaPlacement_delete(NumaPlacement* numaPlacement);
+
+// Pins every worker to the CPUs of one node, and reports on stderr the
+// workers that could not be pinned.
+void NumaPlacement_pinWorkers(NumaPlacement* numaPlacement);
+
+// Moves the lines of the collision world into per-node slabs.  The order of
+// collisionWorld->lines is unchanged.  On the first call the collision world
+// becomes owner of the NumaPlacement, and frees it in CollisionWorld_delete.
+void NumaPlacement_placeLines(NumaPlacement* numaPlacement,
+                              CollisionWorld* collisionWorld);
+
+#endif  // NUMA_H_
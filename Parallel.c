@@ -0,0 +1,483 @@
+/**
+ * Parallel.c -- parallel loops and reductions on a pluggable backend
+ *
+ * Function definitions in Parallel.h
+ **/
+
+#include "Parallel.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(PARALLEL_BUILTIN)
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#elif defined(PARALLEL_CILK)
+#include <cilk/cilk.h>
+#endif
+
+#if !defined(PARALLEL_SERIAL)
+// Default grain size: about 8 ranges per worker, as cilk_for picks.
+static int defaultGrainSize(int numIterations) {
+  int ranges = 8 * Parallel_numWorkers();
+  int grainSize = (numIterations + ranges - 1) / ranges;
+  if (grainSize > 2048) {
+    grainSize = 2048;
+  }
+  return grainSize < 1 ? 1 : grainSize;
+}
+#endif
+
+#if defined(PARALLEL_BUILTIN)
+
+// Workers are threads, each with a Chase-Lev deque of ranges.  A worker
+// running a range larger than the grain size pushes its upper half and
+// keeps the lower half, like cilk_for's divide and conquer; idle workers
+// steal from the top of other workers' deques.  The thread starting an
+// outermost loop becomes worker 0 until the loop is done, and a worker
+// waiting for a loop to finish runs other ranges meanwhile.  Idle workers
+// that find nothing to steal for a while sleep until a range is pushed.
+
+#define DEQUE_SIZE 8192  // a power of 2
+
+// Failed steals before an idle worker yields between attempts, and before
+// it sleeps.
+#define STEAL_SPINS 64
+#define STEAL_YIELDS 1024
+
+// A loop in flight.
+typedef struct Loop {
+  Parallel_body body;
+  void* context;
+  int grainSize;
+
+  // Ranges of the loop not yet finished.
+  int pending;
+} Loop;
+
+typedef struct Range {
+  Loop* loop;
+  int begin;
+  int end;
+} Range;
+
+typedef struct Deque {
+  int64_t top;
+  char pad1[PARALLEL_CACHE_LINE - sizeof(int64_t)];
+  int64_t bottom;
+  char pad2[PARALLEL_CACHE_LINE - sizeof(int64_t)];
+  // By value, so splitting a range allocates nothing.  A thief may read a
+  // slot as it is rewritten, but then its CAS on top fails.
+  Range ranges[DEQUE_SIZE];
+} Deque;
+
+__thread int Parallel_currentWorker = -1;
+
+static int numWorkers = 0;
+static Deque* deques;
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+
+// Workers sleep while no outermost loop is running.
+static pthread_mutex_t idleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idleCond = PTHREAD_COND_INITIALIZER;
+static int numActiveLoops = 0;
+
+// Idle workers sleeping on pushedCond until a range is pushed.
+static int numSleeping = 0;
+static pthread_cond_t pushedCond = PTHREAD_COND_INITIALIZER;
+
+// Outermost loops run one at a time.
+static pthread_mutex_t callerLock = PTHREAD_MUTEX_INITIALIZER;
+
+// The hook of Parallel_onEachWorker, under idleLock.  Each worker runs it
+// once per generation and counts itself in numHooked.
+static Parallel_workerHook workerHook = NULL;
+static void* workerHookContext = NULL;
+static int hookGeneration = 0;
+static int numHooked = 0;
+static pthread_cond_t hookedCond = PTHREAD_COND_INITIALIZER;
+
+static void storeRange(Range* slot, Loop* loop, int begin, int end) {
+  __atomic_store_n(&slot->loop, loop, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->begin, begin, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->end, end, __ATOMIC_RELAXED);
+}
+
+static Range loadRange(Range* slot) {
+  Range range;
+  range.loop = __atomic_load_n(&slot->loop, __ATOMIC_RELAXED);
+  range.begin = __atomic_load_n(&slot->begin, __ATOMIC_RELAXED);
+  range.end = __atomic_load_n(&slot->end, __ATOMIC_RELAXED);
+  return range;
+}
+
+// Owner only: push a range onto the bottom.  Returns false if full.
+static bool Deque_push(Deque* deque, Loop* loop, int begin, int end) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  if (bottom - top >= DEQUE_SIZE) {
+    return false;
+  }
+  storeRange(&deque->ranges[bottom & (DEQUE_SIZE - 1)], loop, begin, end);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Any thread: whether the deque looks nonempty.
+static bool Deque_hasRanges(Deque* deque) {
+  return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE)
+      < __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+
+// Owner only: take a range from the bottom.  Returns false if none.
+static bool Deque_take(Deque* deque, Range* range) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+  bool taken = false;
+  if (top <= bottom) {
+    *range = loadRange(&deque->ranges[bottom & (DEQUE_SIZE - 1)]);
+    taken = true;
+    if (top == bottom) {
+      // last range: race the thieves for it
+      if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        taken = false;
+      }
+      __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return taken;
+}
+
+// Any thread: steal a range from the top.  Returns false if none.
+static bool Deque_steal(Deque* deque, Range* range) {
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) {
+    return false;
+  }
+  *range = loadRange(&deque->ranges[top & (DEQUE_SIZE - 1)]);
+  return __atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+// Wake a sleeping worker, if any, for the range just pushed.  Pairs with the fence
+// in sleepUntilPushed: either the pusher sees the sleeper counted, or the
+// sleeper sees the pushed range.
+static void wakeSleepers() {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&numSleeping, __ATOMIC_RELAXED) > 0) {
+    pthread_mutex_lock(&idleLock);
+    pthread_cond_signal(&pushedCond);
+    pthread_mutex_unlock(&idleLock);
+  }
+}
+
+// Sleep until a range is pushed, unless some deque already has one.
+static void sleepUntilPushed() {
+  pthread_mutex_lock(&idleLock);
+  __atomic_add_fetch(&numSleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  bool found = false;
+  for (int victim = 0; victim < numWorkers && !found; victim++) {
+    found = Deque_hasRanges(&deques[victim]);
+  }
+  if (!found && numActiveLoops > 0) {
+    pthread_cond_wait(&pushedCond, &idleLock);
+  }
+  __atomic_sub_fetch(&numSleeping, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&idleLock);
+}
+
+// Split a range down to the grain size, then run what is left of it.
+static void runRange(int worker, Loop* loop, int begin, int end) {
+  while (end - begin > loop->grainSize) {
+    int middle = begin + (end - begin) / 2;
+    __atomic_add_fetch(&loop->pending, 1, __ATOMIC_RELAXED);
+    if (!Deque_push(&deques[worker], loop, middle, end)) {
+      // the deque is full: run the rest here
+      __atomic_sub_fetch(&loop->pending, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    wakeSleepers();
+    end = middle;
+  }
+  loop->body(loop->context, begin, end);
+  __atomic_sub_fetch(&loop->pending, 1, __ATOMIC_RELEASE);
+}
+
+// Take a range from our own deque, or steal one; returns false if none.
+static bool runOne(int worker, unsigned int* seed) {
+  Range range;
+  bool found = Deque_take(&deques[worker], &range);
+  if (!found) {
+    int victim = rand_r(seed) % numWorkers;
+    for (int i = 0; i < numWorkers && !found; i++) {
+      if (victim != worker) {
+        found = Deque_steal(&deques[victim], &range);
+      }
+      victim = victim + 1 == numWorkers ? 0 : victim + 1;
+    }
+  }
+  if (!found) {
+    return false;
+  }
+  runRange(worker, range.loop, range.begin, range.end);
+  return true;
+}
+
+static void* workerMain(void* arg) {
+  const int worker = (int) (intptr_t) arg;
+  unsigned int seed = worker;
+  int generation = 0;
+  Parallel_currentWorker = worker;
+
+  while (true) {
+    pthread_mutex_lock(&idleLock);
+    while (numActiveLoops == 0 && generation == hookGeneration) {
+      pthread_cond_wait(&idleCond, &idleLock);
+    }
+    if (generation != hookGeneration) {
+      generation = hookGeneration;
+      Parallel_workerHook hook = workerHook;
+      void* context = workerHookContext;
+      pthread_mutex_unlock(&idleLock);
+      hook(context, worker);
+      pthread_mutex_lock(&idleLock);
+      numHooked++;
+      pthread_cond_broadcast(&hookedCond);
+      pthread_mutex_unlock(&idleLock);
+      continue;
+    }
+    pthread_mutex_unlock(&idleLock);
+
+    // steal until the loop is done; spin, then yield, then sleep
+    int misses = 0;
+    while (__atomic_load_n(&numActiveLoops, __ATOMIC_RELAXED) > 0) {
+      if (runOne(worker, &seed)) {
+        misses = 0;
+      } else if (++misses > STEAL_YIELDS) {
+        sleepUntilPushed();
+        misses = 0;
+      } else if (misses > STEAL_SPINS) {
+        sched_yield();
+      }
+    }
+  }
+  return NULL;
+}
+
+static void startPool() {
+  const char* env = getenv("PARALLEL_NUM_WORKERS");
+  numWorkers = env != NULL ? atoi(env) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (numWorkers < 1) {
+    numWorkers = 1;
+  }
+  if (posix_memalign((void**) &deques, PARALLEL_CACHE_LINE,
+                     numWorkers * sizeof(Deque)) != 0) {
+    abort();
+  }
+  memset(deques, 0, numWorkers * sizeof(Deque));
+
+  for (int worker = 1; worker < numWorkers; worker++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, workerMain, (void*) (intptr_t) worker);
+    pthread_detach(thread);
+  }
+}
+
+int Parallel_numWorkers() {
+  pthread_once(&poolOnce, startPool);
+  return numWorkers;
+}
+
+bool Parallel_onEachWorker(Parallel_workerHook hook, void* context) {
+  pthread_once(&poolOnce, startPool);
+  // no loop can start meanwhile, so every worker is on its way to idle
+  pthread_mutex_lock(&callerLock);
+  pthread_mutex_lock(&idleLock);
+  workerHook = hook;
+  workerHookContext = context;
+  numHooked = 0;
+  hookGeneration++;
+  pthread_cond_broadcast(&idleCond);
+  pthread_cond_broadcast(&pushedCond);
+  while (numHooked < numWorkers - 1) {
+    pthread_cond_wait(&hookedCond, &idleLock);
+  }
+  pthread_mutex_unlock(&idleLock);
+  hook(context, 0);
+  pthread_mutex_unlock(&callerLock);
+  return true;
+}
+
+void Parallel_for(int begin, int end, int grainSize, Parallel_body body,
+                  void* context) {
+  if (begin >= end) {
+    return;
+  }
+  pthread_once(&poolOnce, startPool);
+  Loop loop;
+  loop.body = body;
+  loop.context = context;
+  loop.grainSize = grainSize > 0 ? grainSize : defaultGrainSize(end - begin);
+  loop.pending = 1;
+
+  const bool outermost = Parallel_currentWorker < 0;
+  if (outermost) {
+    pthread_mutex_lock(&callerLock);
+    Parallel_currentWorker = 0;
+    pthread_mutex_lock(&idleLock);
+    __atomic_add_fetch(&numActiveLoops, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&idleCond);
+    pthread_mutex_unlock(&idleLock);
+  }
+
+  const int worker = Parallel_currentWorker;
+  unsigned int seed = worker;
+  runRange(worker, &loop, begin, end);
+  while (__atomic_load_n(&loop.pending, __ATOMIC_ACQUIRE) > 0) {
+    runOne(worker, &seed);
+  }
+
+  if (outermost) {
+    pthread_mutex_lock(&idleLock);
+    __atomic_sub_fetch(&numActiveLoops, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&idleLock);
+    Parallel_currentWorker = -1;
+    pthread_mutex_unlock(&callerLock);
+  }
+}
+
+#elif defined(PARALLEL_CILK)
+
+typedef struct CilkLoop {
+  Parallel_body body;
+  void* context;
+  int begin;
+  int end;
+  int grainSize;
+} CilkLoop;
+
+int Parallel_numWorkers() {
+  return __cilkrts_get_nworkers();
+}
+
+bool Parallel_onEachWorker(Parallel_workerHook hook, void* context) {
+  return false;
+}
+
+void Parallel_for(int begin, int end, int grainSize, Parallel_body body,
+                  void* context) {
+  if (begin >= end) {
+    return;
+  }
+  if (grainSize <= 0) {
+    grainSize = defaultGrainSize(end - begin);
+  }
+  const int numRanges = (end - begin + grainSize - 1) / grainSize;
+  #pragma cilk grainsize = 1
+  cilk_for (int range = 0; range < numRanges; range++) {
+    int rangeBegin = begin + range * grainSize;
+    int rangeEnd = rangeBegin + grainSize < end ? rangeBegin + grainSize : end;
+    body(context, rangeBegin, rangeEnd);
+  }
+}
+
+#elif defined(PARALLEL_OPENMP)
+
+static int numWorkers = 0;
+
+int Parallel_numWorkers() {
+  if (numWorkers == 0) {
+    numWorkers = omp_get_max_threads();
+  }
+  return numWorkers;
+}
+
+bool Parallel_onEachWorker(Parallel_workerHook hook, void* context) {
+  return false;
+}
+
+static void runRanges(int begin, int end, int grainSize, Parallel_body body,
+                      void* context) {
+  const int numRanges = (end - begin + grainSize - 1) / grainSize;
+  #pragma omp taskloop grainsize(1)
+  for (int range = 0; range < numRanges; range++) {
+    int rangeBegin = begin + range * grainSize;
+    int rangeEnd = rangeBegin + grainSize < end ? rangeBegin + grainSize : end;
+    body(context, rangeBegin, rangeEnd);
+  }
+}
+
+void Parallel_for(int begin, int end, int grainSize, Parallel_body body,
+                  void* context) {
+  if (begin >= end) {
+    return;
+  }
+  if (grainSize <= 0) {
+    grainSize = defaultGrainSize(end - begin);
+  }
+  // nested loops become tasks of the enclosing team
+  if (omp_in_parallel()) {
+    runRanges(begin, end, grainSize, body, context);
+  } else {
+    #pragma omp parallel num_threads(Parallel_numWorkers())
+    #pragma omp single
+    runRanges(begin, end, grainSize, body, context);
+  }
+}
+
+#else  // PARALLEL_SERIAL
+
+int Parallel_numWorkers() {
+  return 1;
+}
+
+bool Parallel_onEachWorker(Parallel_workerHook hook, void* context) {
+  hook(context, 0);
+  return true;
+}
+
+void Parallel_for(int begin, int end, int grainSize, Parallel_body body,
+                  void* context) {
+  if (begin < end) {
+    body(context, begin, end);
+  }
+}
+
+#endif
+
+void ParallelCounter_init(ParallelCounter* counter) {
+  const int numViews = Parallel_numWorkers();
+  if (posix_memalign((void**) &counter->views, PARALLEL_CACHE_LINE,
+                     numViews * sizeof(ParallelCounterView)) != 0) {
+    abort();
+  }
+  ParallelCounter_reset(counter);
+}
+
+void ParallelCounter_destroy(ParallelCounter* counter) {
+  free(counter->views);
+  counter->views = NULL;
+}
+
+int ParallelCounter_sum(ParallelCounter* counter) {
+  int sum = 0;
+  for (int i = 0; i < Parallel_numWorkers(); i++) {
+    sum += counter->views[i].value;
+  }
+  return sum;
+}
+
+void ParallelCounter_reset(ParallelCounter* counter) {
+  memset(counter->views, 0, Parallel_numWorkers() * sizeof(ParallelCounterView));
+}
@@ -0,0 +1,103 @@
+/**
+ * Parallel.h -- parallel loops and reductions on a pluggable backend
+ *
+ * The backend is chosen at build time (see the Makefile's PARALLEL=...):
+ *   PARALLEL_BUILTIN  a work-stealing thread pool with Chase-Lev deques
+ *                     (the default)
+ *   PARALLEL_CILK     Cilk Plus, for compilers that still ship it
+ *   PARALLEL_OPENMP   OpenMP tasks
+ *   PARALLEL_SERIAL   everything runs on the calling thread
+ *
+ * Loops hand their body a range of iterations at a time.  Reductions keep
+ * one view per worker, indexed by Parallel_workerNumber(), and combine the
+ * views once the parallel work is done.
+ **/
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <stdbool.h>
+
+#if !defined(PARALLEL_CILK) && !defined(PARALLEL_OPENMP) \
+    && !defined(PARALLEL_SERIAL) && !defined(PARALLEL_BUILTIN)
+#define PARALLEL_BUILTIN
+#endif
+
+#if defined(PARALLEL_CILK)
+#include <cilk/cilk_api.h>
+#elif defined(PARALLEL_OPENMP)
+#include <omp.h>
+#endif
+
+// Views of reductions are padded to a cache line so workers do not share
+// lines.
+#define PARALLEL_CACHE_LINE 64
+
+// Runs iterations [begin, end) of a loop.
+typedef void (*Parallel_body)(void* context, int begin, int end);
+
+// Runs body over [begin, end), split into ranges of at most grainSize
+// iterations, and returns once every iteration has run.  A grainSize of 0
+// lets the backend choose.  Loops may be nested.
+void Parallel_for(int begin, int end, int grainSize, Parallel_body body,
+                  void* context);
+
+// Number of workers, and so of views a reduction needs.
+int Parallel_numWorkers();
+
+// Runs on the thread of one worker.
+typedef void (*Parallel_workerHook)(void* context, int worker);
+
+// Runs hook once on the thread of every worker and returns when all have.
+// Pool workers run it in workerMain before they take any more ranges,
+// including workers that start later; the calling thread runs it as worker
+// 0, since the thread starting a loop is worker 0.  Call outside parallel
+// loops.  Returns false without running it if the backend's threads cannot
+// be reached (Cilk; OpenMP binds its own with OMP_PROC_BIND/OMP_PLACES).
+bool Parallel_onEachWorker(Parallel_workerHook hook, void* context);
+
+#if defined(PARALLEL_BUILTIN)
+// Number of the pool worker the calling thread is, or -1.
+extern __thread int Parallel_currentWorker;
+#endif
+
+// Number of the worker running the caller, in [0, Parallel_numWorkers()).
+// Threads outside the parallel loops count as worker 0.
+static inline int Parallel_workerNumber() {
+#if defined(PARALLEL_BUILTIN)
+  return Parallel_currentWorker < 0 ? 0 : Parallel_currentWorker;
+#elif defined(PARALLEL_CILK)
+  int worker = __cilkrts_get_worker_number();
+  return worker < 0 ? 0 : worker;
+#elif defined(PARALLEL_OPENMP)
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+typedef struct ParallelCounterView {
+  int value;
+} __attribute__((aligned(PARALLEL_CACHE_LINE))) ParallelCounterView;
+
+// An integer sum over all workers.
+typedef struct ParallelCounter {
+  ParallelCounterView* views;
+} ParallelCounter;
+
+void ParallelCounter_init(ParallelCounter* counter);
+
+void ParallelCounter_destroy(ParallelCounter* counter);
+
+// The calling worker's part of the sum.
+static inline int* ParallelCounter_view(ParallelCounter* counter) {
+  return &counter->views[Parallel_workerNumber()].value;
+}
+
+// Sums the views.  Call only outside parallel loops.
+int ParallelCounter_sum(ParallelCounter* counter);
+
+// Zeroes every view.
+void ParallelCounter_reset(ParallelCounter* counter);
+
+#endif  // PARALLEL_H_
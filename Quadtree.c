@@ -5,29 +5,32 @@
  **/
  
 #include "Quadtree.h"
+#include <assert.h>
+#include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "CollisionWorld.h"
 #include "Line.h"
 #include "Vec.h"
 #include "IntersectionEventList.h"
 #include "IntersectionDetection.h"
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
-#include <cilk/reducer_opadd.h>
+#include "Parallel.h"
+#include "Arena.h"
+#include "LinearQuadtree.h"
 
 ///////////////////////////////////////////////////////////
-// Create the quadtree.
+// Set up a node of the pool.
 //
+// quadtree -> the node to set up
 // collisionWorld -> the collision world in which the quadtree is created
 // upperLeft -> the upper left point of the quadtree
 // lowerRight -> the lower right point of the quadtree
 // parent -> the parent quadtree node of this quadtree node
-Quadtree* Quadtree_new(CollisionWorld* collisionWorld, Vec upperLeft, Vec lowerRight, Quadtree* parent) {
-  Quadtree* quadtree = malloc(sizeof(Quadtree));
-  if (quadtree == NULL) {
-    return NULL;
-  }
+// arena -> the arena the buckets are drawn from
+static void initNode(Quadtree* quadtree, CollisionWorld* collisionWorld,
+                     Vec upperLeft, Vec lowerRight, Quadtree* parent,
+                     Arena* arena) {
   quadtree->collisionWorld = collisionWorld;
   quadtree->upperLeft = upperLeft;
   quadtree->lowerRight = lowerRight;
@@ -36,63 +39,122 @@ Quadtree* Quadtree_new(CollisionWorld* collisionWorld, Vec upperLeft, Vec lowerR
   if (parent != NULL){
     quadtree->parent = parent;
     quadtree->depth = quadtree->parent->depth+1;
+    quadtree->leafDepth = parent->leafDepth;
+    quadtree->linear = parent->linear;
   } else {
     quadtree->parent = NULL;
     quadtree->depth = 0;
+    quadtree->leafDepth = collisionWorld->quadtreeDepth;
+    quadtree->linear = collisionWorld->linearQuadtree;
   }
 
-  // allocate the line array
+  quadtree->arena = arena;
+  quadtree->lines = NULL;
   quadtree->numOfLines = 0;
-  quadtree->lines = malloc(MAX_LINES_PER_NODE * sizeof(Line*));
+  quadtree->lineCapacity = INITIAL_LEAF_CAPACITY;
+  quadtree->scratch = NULL;
   quadtree->isLeaf = !shouldDivideTree(quadtree);
 
-  // if the quadtree is not a leaf, then recursively create four
-  // new quadtree nodes
+  // if the quadtree is not a leaf, then recursively set up its four
+  // quadrants
   if (!(quadtree->isLeaf)){
-    quadtree->quadrants = malloc(4 * sizeof(Quadtree*));
     divideTree(quadtree);
-  } else {
+    return;
+  }
+
+  // leaves are numbered from the first node of the deepest level
+  Quadtree* root = quadtree;
+  while (root->parent != NULL) {
+    root = root->parent;
+  }
+  quadtree->leafCode = (quadtree - root) - ((1 << (2 * quadtree->depth)) - 1) / 3;
+  if (!quadtree->linear){
     updateLines(quadtree);
   }
-  return quadtree;
+}
+
+///////////////////////////////////////////////////////////
+// Create the quadtree.  The nodes are laid out in the pool as a complete
+// 4-ary tree: the quadrants of node k are nodes 4k+1 to 4k+4.
+//
+// collisionWorld -> the collision world in which the quadtree is created
+// upperLeft -> the upper left point of the quadtree
+// lowerRight -> the lower right point of the quadtree
+Quadtree* Quadtree_new(CollisionWorld* collisionWorld, Vec upperLeft, Vec lowerRight) {
+  const unsigned int depth = collisionWorld->quadtreeDepth;
+  assert(depth <= QUADTREE_MAX_DEPTH);
+  Quadtree* pool = malloc(QUADTREE_NUM_NODES(depth) * sizeof(Quadtree));
+  if (pool == NULL) {
+    return NULL;
+  }
+  const unsigned int numLeaves = 1 << (2 * depth);
+  Arena* arena = Arena_new(numLeaves * INITIAL_LEAF_CAPACITY
+                           * (sizeof(Line*) + sizeof(LineScratch)));
+  if (arena == NULL) {
+    free(pool);
+    return NULL;
+  }
+  initNode(pool, collisionWorld, upperLeft, lowerRight, NULL, arena);
+  if (pool->linear) {
+    LinearQuadtree_build(pool);
+  }
+  return pool;
 }
 
 ///////////////////////////////////////////////////////////
 // Delete the quadtree and deallocate.
-// We parallelize the deletion
 void Quadtree_delete(Quadtree* quadtree){
-  free(quadtree->lines);
-  if (!(quadtree->isLeaf)){
-    cilk_spawn Quadtree_delete(quadtree->quadrants[0]);
-    cilk_spawn Quadtree_delete(quadtree->quadrants[1]);
-    cilk_spawn Quadtree_delete(quadtree->quadrants[2]);
-    Quadtree_delete(quadtree->quadrants[3]);
-    cilk_sync;
-    free(quadtree->quadrants);
-  }
+  assert(quadtree->parent == NULL);
+  Arena_delete(quadtree->arena);
   free(quadtree);
 }
 
 ///////////////////////////////////////////////////////////
 // Update the quadtree--we parallelize this update.
-void Quadtree_update(Quadtree* quadtree){
+static void updateNode(Quadtree* quadtree);
+
+static void updateQuadrants(void* context, int begin, int end){
+  Quadtree* quadtree = (Quadtree*) context;
+  for (int i = begin; i < end; i++) {
+    updateNode(quadtree->quadrants[i]);
+  }
+}
+
+static void updateNode(Quadtree* quadtree){
   if (quadtree->isLeaf){
     updateLines(quadtree);
   }
   else {
-    cilk_for (int i = 0; i < 4; i++) {
-       Quadtree_update(quadtree->quadrants[i]);
-    }
+    Parallel_for(0, 4, 1, updateQuadrants, quadtree);
+  }
+}
+
+///////////////////////////////////////////////////////////
+// Refill the leaves below quadtree.  While the lines' leaf masks are valid
+// the pointer quadtree is filled like the linear one, bucketing each line
+// by its mask in one pass over the lines instead of one pass per leaf.
+void Quadtree_update(Quadtree* quadtree){
+  Arena_reset(quadtree->arena);
+  if (quadtree->linear || quadtree->collisionWorld->leafMasksValid) {
+    LinearQuadtree_build(quadtree);
+  } else {
+    updateNode(quadtree);
   }
 }
 
 ///////////////////////////////////////////////////////////
-// Update all of the line positions of the lines in the quadtree.
+// Update all of the line positions of the lines in the quadtree.  A bucket
+// sized by LinearQuadtree_build may be empty, so it starts at least at the
+// initial capacity for addLine to double.
 inline void updateLines(Quadtree* quadtree){
   quadtree->numOfLines = 0;
-  int qNum = quadtree->collisionWorld->numOfLines;
+  quadtree->lineCapacity = MAX(quadtree->lineCapacity, INITIAL_LEAF_CAPACITY);
+  quadtree->lines = Arena_alloc(quadtree->arena,
+                                quadtree->lineCapacity * sizeof(Line*));
+  CollisionWorld* collisionWorld = quadtree->collisionWorld;
+  int qNum = collisionWorld->numOfLines;
   for (int i = 0; i < qNum; i++){
-    Line* line = quadtree->collisionWorld->lines[i];
+    Line* line = collisionWorld->lines[i];
     if (isLineInQuadtree(quadtree, line)){
       addLine(quadtree, line);
     }
@@ -103,50 +165,71 @@ inline void updateLines(Quadtree* quadtree){
 // Determine whether we should divide the quadtree into four
 // separate quadtree nodes.
 inline bool shouldDivideTree(Quadtree* quadtree){
-  return quadtree->depth < MAX_DEPTH;
+  return quadtree->depth < quadtree->leafDepth;
 }
 
 ///////////////////////////////////////////////////////////
 // Divides the given quadtree into four separate quadtree nodes.
 inline void divideTree(Quadtree* quadtree){
+  // the quadrants' place in the pool follows from this node's
+  Quadtree* root = quadtree;
+  while (root->parent != NULL) {
+    root = root->parent;
+  }
+  Quadtree* children = root + 4 * (quadtree - root) + 1;
+  for (int i = 0; i < 4; i++) {
+    quadtree->quadrants[i] = &children[i];
+  }
+
   // break the tree up into 4 quadrants
   Vec centerPoint = Vec_divide(Vec_add(quadtree->lowerRight,quadtree->upperLeft),2);
-  quadtree->quadrants[0] = Quadtree_new(quadtree->collisionWorld, 
+  initNode(quadtree->quadrants[0], quadtree->collisionWorld, 
     quadtree->upperLeft, 
     centerPoint,
-    quadtree);
-  quadtree->quadrants[1] = Quadtree_new(quadtree->collisionWorld, 
+    quadtree, quadtree->arena);
+  initNode(quadtree->quadrants[1], quadtree->collisionWorld, 
     Vec_make(centerPoint.x, quadtree->upperLeft.y), 
     Vec_make(quadtree->lowerRight.x, centerPoint.y),
-    quadtree);
-  quadtree->quadrants[2] = Quadtree_new(quadtree->collisionWorld, 
+    quadtree, quadtree->arena);
+  initNode(quadtree->quadrants[2], quadtree->collisionWorld, 
     Vec_make(quadtree->upperLeft.x, centerPoint.y), 
     Vec_make(centerPoint.x, quadtree->lowerRight.y),
-    quadtree);
-  quadtree->quadrants[3] = Quadtree_new(quadtree->collisionWorld, 
+    quadtree, quadtree->arena);
+  initNode(quadtree->quadrants[3], quadtree->collisionWorld, 
     centerPoint, 
     quadtree->lowerRight,
-    quadtree);
+    quadtree, quadtree->arena);
 }
 
 ///////////////////////////////////////////////////////////
-// Adds a line to a given quadtree.
-inline bool addLine(Quadtree* quadtree, Line* line){
-  quadtree->numOfLines++;
-  if (quadtree->numOfLines > MAX_LINES_PER_NODE){
-    quadtree->numOfLines = 0;
-    return false;
+// Adds a line to a given quadtree.  A full bucket is moved to a new one
+// twice its size; the old one is reclaimed with the rest of the arena.
+inline void addLine(Quadtree* quadtree, Line* line){
+  if (quadtree->numOfLines == quadtree->lineCapacity){
+    Line** bucket = Arena_alloc(quadtree->arena,
+                                2 * quadtree->lineCapacity * sizeof(Line*));
+    memcpy(bucket, quadtree->lines, quadtree->numOfLines * sizeof(Line*));
+    quadtree->lines = bucket;
+    quadtree->lineCapacity *= 2;
   }
-  quadtree->lines[quadtree->numOfLines-1] = line;
-  return true;
+  quadtree->lines[quadtree->numOfLines++] = line;
 }
 
 ///////////////////////////////////////////////////////////
-// Checks whether a line is in the quadtree. 
-// We treat the line as a parallelogram and the quadtree
-// as a box, and check whether the parallelogram and the quadtree
-// box overlap.
-inline bool isLineInQuadtree(Quadtree* quadtree, Line* line){
+// Checks whether a line is in the quadtree.  We treat the line as a
+// parallelogram and the quadtree as a box, and look for an axis separating
+// the two: the box's axes or the normals of the parallelogram's sides.  If
+// there is none they overlap.  Touching counts as overlapping.
+
+#if defined(CLASSIFIER_STATS)
+ClassifierStats Quadtree_classifierStats;
+
+///////////////////////////////////////////////////////////
+// The test isLineInQuadtree used to make, kept to measure against.  It
+// only looks for the box's edges crossing two of the parallelogram's edges,
+// so it misses lines whose parallelogram covers a box corner without a
+// vertex inside the box.
+static bool isLineInQuadtreeLegacy(Quadtree* quadtree, Line* line){
   // make the half of the bounding box of the quadtree
   Vec box_p1 = quadtree->upperLeft;
   Vec box_p4 = quadtree->lowerRight;
@@ -220,72 +303,493 @@ inline bool isLineInQuadtree(Quadtree* quadtree, Line* line){
 
   return false;
 }
+#endif
 
-///////////////////////////////////////////////////////////
-// Use reducers to detect whether
-void detectCollisionsReducer(Quadtree* quadtree, IntersectionEventListReducer* intersectionEventList, CILK_C_REDUCER_OPADD_TYPE(int)* numCollisions){
+// Project the parallelogram and the box onto the normal of edge and check
+// whether the projections overlap.  A zero edge never separates.
+static inline bool overlapOnNormal(Vec edge, Line* line, Vec boxMin, Vec boxMax){
+  double nx = -edge.y;
+  double ny = edge.x;
+  double q1 = line->p1.x * nx + line->p1.y * ny;
+  double q2 = line->p2.x * nx + line->p2.y * ny;
+  double q3 = line->p3.x * nx + line->p3.y * ny;
+  double q4 = line->p4.x * nx + line->p4.y * ny;
+  double boxLow = (nx >= 0 ? boxMin.x : boxMax.x) * nx
+                  + (ny >= 0 ? boxMin.y : boxMax.y) * ny;
+  double boxHigh = (nx >= 0 ? boxMax.x : boxMin.x) * nx
+                   + (ny >= 0 ? boxMax.y : boxMin.y) * ny;
+  return MAX_4(q1, q2, q3, q4) >= boxLow && MIN_4(q1, q2, q3, q4) <= boxHigh;
+}
+
+static inline bool parallelogramOverlapsBox(Line* line, Vec boxMin, Vec boxMax){
+  // the box's axes
+  if (line->sweptMax.x < boxMin.x || line->sweptMin.x > boxMax.x){
+    return false;
+  }
+  if (line->sweptMax.y < boxMin.y || line->sweptMin.y > boxMax.y){
+    return false;
+  }
+
+  // the normals of the line and of its motion
+  return overlapOnNormal(line->direction, line, boxMin, boxMax)
+      && overlapOnNormal(line->shift, line, boxMin, boxMax);
+}
+
+inline bool isLineInQuadtree(Quadtree* quadtree, Line* line){
+  bool inside = parallelogramOverlapsBox(line, quadtree->upperLeft,
+                                         quadtree->lowerRight);
+#if defined(CLASSIFIER_STATS)
+  bool legacy = isLineInQuadtreeLegacy(quadtree, line);
+  ClassifierStats* stats = &Quadtree_classifierStats;
+  __sync_fetch_and_add(&stats->tests, 1);
+  if (inside) {
+    __sync_fetch_and_add(&stats->members, 1);
+  }
+  if (legacy) {
+    __sync_fetch_and_add(&stats->legacyMembers, 1);
+  }
+  if (legacy && !inside) {
+    __sync_fetch_and_add(&stats->legacyFalsePositives, 1);
+  }
+  if (inside && !legacy) {
+    __sync_fetch_and_add(&stats->legacyFalseNegatives, 1);
+  }
+#endif
+  return inside;
+}
+
+// Every leaf a line is in lies in quadrants its swept box overlaps, so
+// only those are descended into, and only leaves get the exact test.
+static uint64_t leafMaskBelow(Quadtree* quadtree, Line* line){
   if (quadtree->isLeaf){
-    // iterate through all lines in the quadtree and detect collisions
-    //double timestep = quadtree->collisionWorld->timeStep;
-    
-    cilk_for (int i = 0; i < quadtree->numOfLines; i++) {
-      Line *l1 = quadtree->lines[i];
-
-
-      for (int j = i+1; j < quadtree->numOfLines; j++) {
-        Line *l2 = quadtree->lines[j];
-
-        // intersect expects compareLines(l1, l2) < 0 to be true.
-        // Swap l1 and l2, if necessary.
-        if (compareLines(l1, l2) >= 0) {
-          Vec p1;
-          Vec p2;
-          // Get relative velocity.
-          Vec shift;
-          shift.x = l1->shift.x - l2->shift.x;
-          shift.y = l1->shift.y - l2->shift.y;
-
-          // Get the parallelogram.
-          p1.x = l1->p1.x + shift.x;
-          p1.y = l1->p1.y + shift.y;
-  
-          p2.x = l1->p2.x + shift.x;
-          p2.y = l1->p2.y + shift.y;
-          if (fastIntersect(l2, l1, p1, p2)) {
-            IntersectionEventList_appendNode(&REDUCER_VIEW(*intersectionEventList), l2, l1,
-                                    intersect(l2, l1, p1, p2));
-            REDUCER_VIEW(*numCollisions)++;        
+    return isLineInQuadtree(quadtree, line) ?
+        (uint64_t) 1 << quadtree->leafCode : 0;
+  }
+  uint64_t mask = 0;
+  for (int i = 0; i < 4; i++) {
+    Quadtree* quadrant = quadtree->quadrants[i];
+    if (line->sweptMax.x >= quadrant->upperLeft.x
+        && line->sweptMin.x <= quadrant->lowerRight.x
+        && line->sweptMax.y >= quadrant->upperLeft.y
+        && line->sweptMin.y <= quadrant->lowerRight.y){
+      mask |= leafMaskBelow(quadrant, line);
+    }
+  }
+  return mask;
+}
+
+uint64_t Quadtree_leafMask(Quadtree* root, Line* line){
+  assert(root->parent == NULL && root->leafDepth <= QUADTREE_MASK_DEPTH);
+  return leafMaskBelow(root, line);
+}
+
+#if defined(CLASSIFIER_STATS)
+void Quadtree_printClassifierStats(FILE* out){
+  ClassifierStats* stats = &Quadtree_classifierStats;
+  fprintf(out, "---- CLASSIFIER ----\n");
+  fprintf(out, "%lu line-leaf tests, %lu members\n", stats->tests,
+          stats->members);
+  fprintf(out, "legacy test: %lu members, %lu false positives (%.4f%%), "
+          "%lu false negatives (%.4f%%)\n", stats->legacyMembers,
+          stats->legacyFalsePositives,
+          stats->legacyMembers > 0 ?
+              100.0 * stats->legacyFalsePositives / stats->legacyMembers : 0,
+          stats->legacyFalseNegatives,
+          stats->members > 0 ?
+              100.0 * stats->legacyFalseNegatives / stats->members : 0);
+}
+#endif
+
+///////////////////////////////////////////////////////////
+// Use reducers to detect whether lines collide.
+//
+// The pairs (i, j), i < j, of every leaf form a triangle.  The triangles
+// are cut into tiles of about equal numbers of pairs, and all tiles of all
+// leaves are run as one flat parallel loop, so a dense leaf next to a
+// sparse one does not leave workers idle.
+//
+// Each tile runs in three stages: the broadphase lists the tile's pairs
+// whose swept boxes overlap, fastIntersect filters them, and intersect
+// classifies the survivors.
+
+// Lines [iBegin, iEnd) of a leaf paired with lines [jBegin, jEnd), j > i
+typedef struct PairTile {
+  Quadtree* leaf;
+  unsigned int iBegin;
+  unsigned int iEnd;
+  unsigned int jBegin;
+  unsigned int jEnd;
+} PairTile;
+
+typedef struct DetectContext {
+  PairTile* tiles;
+  IntersectionEventListReducer* intersectionEventList;
+  ParallelCounter* numCollisions;
+
+  // Pairs reaching fastIntersect and pairs intersect finds colliding, or
+  // NULL if no stats are kept
+  ParallelCounter* boxPairs;
+  ParallelCounter* hits;
+} DetectContext;
+
+// Copy each leaf's lines into its scratch.
+static void fillScratch(void* context, int begin, int end){
+  Quadtree** leaves = (Quadtree**) context;
+  for (int i = begin; i < end; i++) {
+    Quadtree* leaf = leaves[i];
+    leaf->scratch = Arena_alloc(leaf->arena,
+                                leaf->numOfLines * sizeof(LineScratch));
+    for (unsigned int k = 0; k < leaf->numOfLines; k++) {
+      Line* line = leaf->lines[k];
+      leaf->scratch[k].sweptMin = Vec_make(line->sweptMin.x - SWEEP_MARGIN,
+                                           line->sweptMin.y - SWEEP_MARGIN);
+      leaf->scratch[k].sweptMax = Vec_make(line->sweptMax.x + SWEEP_MARGIN,
+                                           line->sweptMax.y + SWEEP_MARGIN);
+      leaf->scratch[k].p1 = line->p1;
+      leaf->scratch[k].p2 = line->p2;
+      leaf->scratch[k].shift = line->shift;
+      leaf->scratch[k].id = line->id;
+    }
+  }
+}
+
+// The parallelogram line b sweeps relative to line a.
+static inline void relativeParallelogram(LineScratch* s1, LineScratch* s2,
+                                         Vec* p1, Vec* p2){
+  // Get relative velocity.
+  Vec shift;
+  shift.x = s2->shift.x - s1->shift.x;
+  shift.y = s2->shift.y - s1->shift.y;
+
+  // Get the parallelogram.
+  p1->x = s2->p1.x + shift.x;
+  p1->y = s2->p1.y + shift.y;
+
+  p2->x = s2->p2.x + shift.x;
+  p2->y = s2->p2.y + shift.y;
+}
+
+#if defined(PIPELINE_STATS)
+PipelineStats* Quadtree_pipelineStats = NULL;
+
+static inline void addStageTime(double* seconds, fasttime_t* last){
+  fasttime_t now = gettime();
+  *seconds += tdiff(*last, now);
+  *last = now;
+}
+#endif
+
+// Run the second and third stages on a batch of pairs of one leaf.  The
+// pairs passing fastIntersect are packed at the front of the batch, and
+// only those reach intersect and the Line structs.  boxPairs and hits are
+// NULL unless stats are kept.
+static void narrowphase(Quadtree* leaf, LinePair* pairs, unsigned int numPairs,
+                        IntersectionEventList* intersectionEventList,
+                        int* numCollisions, int* boxPairs, int* hits){
+#if defined(PIPELINE_STATS)
+  PipelineStats* stats = &Quadtree_pipelineStats[Parallel_workerNumber()];
+  stats->pairs += numPairs;
+  addStageTime(&stats->seconds[BROADPHASE_STAGE], &stats->clock);
+#endif
+  LineScratch* scratch = leaf->scratch;
+  unsigned int numCandidates = 0;
+  for (unsigned int k = 0; k < numPairs; k++) {
+    if (k + PAIR_PREFETCH_DISTANCE < numPairs) {
+      __builtin_prefetch(&scratch[pairs[k + PAIR_PREFETCH_DISTANCE].a]);
+      __builtin_prefetch(&scratch[pairs[k + PAIR_PREFETCH_DISTANCE].b]);
+    }
+    LineScratch* s1 = &scratch[pairs[k].a];
+    LineScratch* s2 = &scratch[pairs[k].b];
+    Vec p1;
+    Vec p2;
+    relativeParallelogram(s1, s2, &p1, &p2);
+    if (fastIntersectPoints(s1->p1, s1->p2, s2->p1, s2->p2, p1, p2)) {
+      pairs[numCandidates++] = pairs[k];
+    }
+  }
+#if defined(PIPELINE_STATS)
+  stats->candidates += numCandidates;
+  addStageTime(&stats->seconds[FAST_STAGE], &stats->clock);
+#endif
+
+  for (unsigned int k = 0; k < numCandidates; k++) {
+    if (k + PAIR_PREFETCH_DISTANCE < numCandidates) {
+      __builtin_prefetch(leaf->lines[pairs[k + PAIR_PREFETCH_DISTANCE].a]);
+      __builtin_prefetch(leaf->lines[pairs[k + PAIR_PREFETCH_DISTANCE].b]);
+    }
+    Vec p1;
+    Vec p2;
+    relativeParallelogram(&scratch[pairs[k].a], &scratch[pairs[k].b], &p1, &p2);
+    Line* l1 = leaf->lines[pairs[k].a];
+    Line* l2 = leaf->lines[pairs[k].b];
+    IntersectionType intersectionType = intersect(l1, l2, p1, p2);
+    if (hits != NULL && intersectionType != NO_INTERSECTION) {
+      (*hits)++;
+    }
+    IntersectionEventList_appendNode(intersectionEventList, l1, l2,
+                                     intersectionType);
+  }
+  (*numCollisions) += numCandidates;
+  if (boxPairs != NULL) {
+    (*boxPairs) += numPairs;
+  }
+#if defined(PIPELINE_STATS)
+  addStageTime(&stats->seconds[INTERSECT_STAGE], &stats->clock);
+#endif
+}
+
+// The first stage walks the pairs of a tile SCRATCH_BLOCK_LINES partners at
+// a time, so the partners stay in L1 while every line of the tile runs past
+// them.  Lines that meet during the step meet inside both their swept
+// boxes, so only pairs whose boxes overlap are written to a batch on the
+// stack.  Full batches, and each tile's last one, go through the other two
+// stages.
+static void detectTiles(void* context, int begin, int end){
+  IntersectionEventList* intersectionEventList =
+      IntersectionEventListReducer_view(((DetectContext*) context)->intersectionEventList);
+  int* numCollisions = ParallelCounter_view(((DetectContext*) context)->numCollisions);
+  int* boxPairs = NULL;
+  int* hits = NULL;
+  if (((DetectContext*) context)->boxPairs != NULL) {
+    boxPairs = ParallelCounter_view(((DetectContext*) context)->boxPairs);
+    hits = ParallelCounter_view(((DetectContext*) context)->hits);
+  }
+  LinePair pairs[PAIR_BATCH_SIZE];
+  unsigned int numPairs = 0;
+#if defined(PIPELINE_STATS)
+  Quadtree_pipelineStats[Parallel_workerNumber()].clock = gettime();
+#endif
+
+  for (int t = begin; t < end; t++) {
+    PairTile* tile = &((DetectContext*) context)->tiles[t];
+    Quadtree* leaf = tile->leaf;
+    LineScratch* scratch = leaf->scratch;
+    for (unsigned int jBlock = tile->jBegin; jBlock < tile->jEnd;
+         jBlock += SCRATCH_BLOCK_LINES) {
+      unsigned int jBlockEnd = MIN(jBlock + SCRATCH_BLOCK_LINES, tile->jEnd);
+      unsigned int iEnd = MIN(tile->iEnd, jBlockEnd - 1);
+      for (unsigned int i = tile->iBegin; i < iEnd; i++) {
+        unsigned int id1 = scratch[i].id;
+        Vec sweptMin = scratch[i].sweptMin;
+        Vec sweptMax = scratch[i].sweptMax;
+        for (unsigned int j = MAX(i + 1, jBlock); j < jBlockEnd; j++) {
+          if (scratch[j].sweptMin.x > sweptMax.x
+              || scratch[j].sweptMax.x < sweptMin.x
+              || scratch[j].sweptMin.y > sweptMax.y
+              || scratch[j].sweptMax.y < sweptMin.y) {
+            continue;
           }
-        }
-        else {
-          Vec p1;
-          Vec p2;
-          // Get relative velocity.
-          Vec shift;
-          shift.x = l2->shift.x - l1->shift.x;
-          shift.y = l2->shift.y - l1->shift.y;
-
-          // Get the parallelogram.
-          p1.x = l2->p1.x + shift.x;
-          p1.y = l2->p1.y + shift.y;
-  
-          p2.x = l2->p2.x + shift.x;
-          p2.y = l2->p2.y + shift.y;
-          if (fastIntersect(l1, l2, p1, p2)) {
-            IntersectionEventList_appendNode(&REDUCER_VIEW(*intersectionEventList), l1, l2,
-                                    intersect(l1, l2, p1, p2));
-            REDUCER_VIEW(*numCollisions)++;        
+
+          // intersect expects compareLines(l1, l2) < 0 to be true.
+          bool swap = scratch[j].id <= id1;
+          pairs[numPairs].a = swap ? j : i;
+          pairs[numPairs].b = swap ? i : j;
+          if (++numPairs == PAIR_BATCH_SIZE) {
+            narrowphase(leaf, pairs, numPairs, intersectionEventList,
+                        numCollisions, boxPairs, hits);
+            numPairs = 0;
           }
         }
       }
     }
-  } 
+    narrowphase(leaf, pairs, numPairs, intersectionEventList, numCollisions,
+                boxPairs, hits);
+    numPairs = 0;
+#if defined(PIPELINE_STATS)
+    for (unsigned int i = tile->iBegin; i < tile->iEnd; i++) {
+      unsigned int jBegin = MAX(i + 1, tile->jBegin);
+      Quadtree_pipelineStats[Parallel_workerNumber()].scanned +=
+          tile->jEnd > jBegin ? tile->jEnd - jBegin : 0;
+    }
+#endif
+  }
+}
+
+static void collectLeaves(Quadtree* quadtree, Quadtree** leaves,
+                          unsigned int* numLeaves){
+  if (quadtree->isLeaf){
+    leaves[(*numLeaves)++] = quadtree;
+  }
   else {
-    // add the collisions for all of the leaves of this quadtree
-    cilk_for (int i = 0; i < 4; i++) {
-      detectCollisionsReducer(quadtree->quadrants[i], intersectionEventList, numCollisions);
+    for (int i = 0; i < 4; i++) {
+      collectLeaves(quadtree->quadrants[i], leaves, numLeaves);
+    }
+  }
+}
+
+static inline double numPairs(unsigned int n){
+  return 0.5 * n * ((double) n - 1);
+}
+
+double Quadtree_numLeafPairs(Quadtree* quadtree){
+  if (quadtree->isLeaf){
+    return numPairs(quadtree->numOfLines);
+  }
+  double pairs = 0;
+  for (int i = 0; i < 4; i++) {
+    pairs += Quadtree_numLeafPairs(quadtree->quadrants[i]);
+  }
+  return pairs;
+}
+
+void detectCollisionsReducer(Quadtree* quadtree, IntersectionEventListReducer* intersectionEventList, ParallelCounter* numCollisions){
+  // a tree of depth d below this node has at most 4^d leaves
+  unsigned int maxLeaves = 1;
+  for (int depth = quadtree->depth; depth < quadtree->leafDepth; depth++) {
+    maxLeaves *= 4;
+  }
+  Quadtree** leaves = malloc(maxLeaves * sizeof(Quadtree*));
+  unsigned int numLeaves = 0;
+  collectLeaves(quadtree, leaves, &numLeaves);
+  Parallel_for(0, numLeaves, 1, fillScratch, leaves);
+
+  // aim for 8 tiles per worker, but not tiles too small to be worth a task
+  double totalPairs = 0;
+  for (int i = 0; i < numLeaves; i++) {
+    totalPairs += numPairs(leaves[i]->numOfLines);
+  }
+  double tilePairs = totalPairs / (8 * Parallel_numWorkers());
+  if (tilePairs < MIN_PAIRS_PER_TILE) {
+    tilePairs = MIN_PAIRS_PER_TILE;
+  }
+  unsigned int blockSize = (unsigned int) sqrt(tilePairs);
+
+  unsigned int numTiles = 0;
+  unsigned int tileCapacity = numLeaves;
+  PairTile* tiles = malloc(tileCapacity * sizeof(PairTile));
+  for (int i = 0; i < numLeaves; i++) {
+    Quadtree* leaf = leaves[i];
+    unsigned int n = leaf->numOfLines;
+    if (n < 2) {
+      continue;
+    }
+
+    // a small leaf is one tile; a large one is cut into square blocks
+    unsigned int block = numPairs(n) <= tilePairs ? n : blockSize;
+    for (unsigned int iBegin = 0; iBegin < n; iBegin += block) {
+      for (unsigned int jBegin = iBegin; jBegin < n; jBegin += block) {
+        if (numTiles == tileCapacity) {
+          tileCapacity *= 2;
+          tiles = realloc(tiles, tileCapacity * sizeof(PairTile));
+        }
+        PairTile* tile = &tiles[numTiles++];
+        tile->leaf = leaf;
+        tile->iBegin = iBegin;
+        tile->iEnd = MIN(iBegin + block, n);
+        tile->jBegin = jBegin;
+        tile->jEnd = MIN(jBegin + block, n);
+      }
     }
   }
+
+  // a grain size on the collision world is a share of the lines per task;
+  // apply the same share to the tiles
+  CollisionWorld* collisionWorld = quadtree->collisionWorld;
+  int grainSize = 1;
+  if (collisionWorld->grainSize > 0 && collisionWorld->numOfLines > 0) {
+    grainSize = MAX(1, (int) ((double) numTiles * collisionWorld->grainSize
+                              / collisionWorld->numOfLines));
+  }
+#if defined(PIPELINE_STATS)
+  if (Quadtree_pipelineStats == NULL) {
+    // one cache line per worker, as for ParallelCounter
+    const int numWorkers = Parallel_numWorkers();
+    if (posix_memalign((void**) &Quadtree_pipelineStats, PARALLEL_CACHE_LINE,
+                       numWorkers * sizeof(PipelineStats)) != 0) {
+      abort();
+    }
+    memset(Quadtree_pipelineStats, 0, numWorkers * sizeof(PipelineStats));
+  }
+#endif
+  QuadtreeStats* stats = collisionWorld->stats;
+  DetectContext context = { tiles, intersectionEventList, numCollisions,
+                            NULL, NULL };
+  ParallelCounter boxPairs;
+  ParallelCounter hits;
+  if (stats != NULL) {
+    ParallelCounter_init(&boxPairs);
+    ParallelCounter_init(&hits);
+    context.boxPairs = &boxPairs;
+    context.hits = &hits;
+  }
+  Parallel_for(0, numTiles, grainSize, detectTiles, &context);
+
+  if (stats != NULL) {
+    stats->numLeaves = numLeaves;
+    for (int i = 0; i < numLeaves; i++) {
+      stats->leafLines[leaves[i]->leafCode] = leaves[i]->numOfLines;
+    }
+    stats->numOfLines = collisionWorld->numOfLines;
+    stats->leafPairs = (unsigned long) totalPairs;
+    stats->boxPairs = ParallelCounter_sum(&boxPairs);
+    stats->candidates = ParallelCounter_sum(numCollisions);
+    stats->hits = ParallelCounter_sum(&hits);
+    stats->duplicates = 0;
+    ParallelCounter_destroy(&boxPairs);
+    ParallelCounter_destroy(&hits);
+  }
+  free(tiles);
+  free(leaves);
+}
+
+void Quadtree_printStats(FILE* out, const QuadtreeStats* stats,
+                         unsigned int frame){
+  unsigned long memberships = 0;
+  unsigned int fullest = 0;
+  unsigned int emptiest = 0;
+  for (unsigned int code = 0; code < stats->numLeaves; code++) {
+    memberships += stats->leafLines[code];
+    if (stats->leafLines[code] > stats->leafLines[fullest]) {
+      fullest = code;
+    }
+    if (stats->leafLines[code] < stats->leafLines[emptiest]) {
+      emptiest = code;
+    }
+  }
+  fprintf(out, "stats: frame %u: %u leaves, lines per leaf %u min, %.1f mean, "
+          "%u max (leaf %u), %.3f leaves per line\n", frame, stats->numLeaves,
+          stats->leafLines[emptiest],
+          (double) memberships / MAX(stats->numLeaves, 1),
+          stats->leafLines[fullest], fullest,
+          (double) memberships / MAX(stats->numOfLines, 1));
+  fprintf(out, "stats: frame %u: %lu leaf pairs, %lu box overlaps, %lu passed "
+          "fastIntersect (%.1f%%), %lu hits, %lu duplicates removed\n", frame,
+          stats->leafPairs, stats->boxPairs, stats->candidates,
+          stats->boxPairs > 0 ? 100.0 * stats->candidates / stats->boxPairs : 0,
+          stats->hits, stats->duplicates);
 }
 
+#if defined(PIPELINE_STATS)
+void Quadtree_printPipelineStats(FILE* out){
+  static const char* names[NUM_PIPELINE_STAGES] = {
+    "broadphase", "fastIntersect", "intersect"
+  };
+  PipelineStats total = { 0 };
+  for (int worker = 0; Quadtree_pipelineStats != NULL
+       && worker < Parallel_numWorkers(); worker++) {
+    PipelineStats* stats = &Quadtree_pipelineStats[worker];
+    total.scanned += stats->scanned;
+    total.pairs += stats->pairs;
+    total.candidates += stats->candidates;
+    for (int stage = 0; stage < NUM_PIPELINE_STAGES; stage++) {
+      total.seconds[stage] += stats->seconds[stage];
+    }
+  }
+  // pairs each stage takes in
+  unsigned long inputs[NUM_PIPELINE_STAGES] = {
+    total.scanned, total.pairs, total.candidates
+  };
+  fprintf(out, "---- PIPELINE ----\n");
+  for (int stage = 0; stage < NUM_PIPELINE_STAGES; stage++) {
+    fprintf(out, "%-14s %12lu pairs %10.6fs %8.2f Mpairs/s\n", names[stage],
+            inputs[stage], total.seconds[stage],
+            total.seconds[stage] > 0 ?
+                inputs[stage] / total.seconds[stage] * 1e-6 : 0);
+  }
+}
 
+void Quadtree_deletePipelineStats() {
+  free(Quadtree_pipelineStats);
+  Quadtree_pipelineStats = NULL;
+}
+#endif
@@ -6,15 +6,43 @@
 #ifndef QUADTREE_H_
 #define QUADTREE_H_
 
+#include <stdio.h>
+
 #include "CollisionWorld.h"
 #include "Line.h"
 #include "Vec.h"
 #include "IntersectionEventList.h"
+#include "Parallel.h"
+#include "Arena.h"
+
+// Depth of the leaves unless the collision world asks for another
+#define QUADTREE_DEPTH 2
+
+// Deepest tree a collision world may ask for
+#define QUADTREE_MAX_DEPTH 4
+
+// Deepest tree whose leaves fit in a Line's leafMask
+#define QUADTREE_MASK_DEPTH 3
+
+// Nodes in a full tree of the given depth, all allocated together
+#define QUADTREE_NUM_NODES(depth) (((1 << (2 * ((depth) + 1))) - 1) / 3)
 
-#include <cilk/reducer_opadd.h>
+// Leaves of the deepest tree
+#define QUADTREE_MAX_LEAVES (1 << (2 * QUADTREE_MAX_DEPTH))
 
-#define MAX_LINES_PER_NODE 300 // Determined from testing increments of 5 from 100 - 170
-#define MAX_DEPTH 2
+// Lines a leaf bucket holds before its first growth
+#define INITIAL_LEAF_CAPACITY 64
+
+// Smallest number of line pairs worth a parallel task
+#define MIN_PAIRS_PER_TILE 2048
+
+// Lines of a leaf's scratch that a tile pairs against at a time; 256 lines
+// of LineScratch take 22 KB, most of a 32 KB L1 data cache
+#define SCRATCH_BLOCK_LINES 256
+
+// Margin on the boxes the broadphase compares, so rounding never drops a
+// pair fastIntersect would accept
+#define SWEEP_MARGIN 1e-9
 
 #define MIN(x,y) (x < y ? x : y)
 #define MIN_4(a,b,c,d) MIN(MIN(a,b), MIN(c,d)) 
@@ -25,6 +53,31 @@
 typedef struct CollisionWorld CollisionWorld;
 typedef struct Quadtree Quadtree;
 
+// Pairs of a tile gathered before they are tested
+#define PAIR_BATCH_SIZE 1024
+
+// How many pairs ahead the tests prefetch their lines
+#define PAIR_PREFETCH_DISTANCE 8
+
+// Two lines of a leaf, by index, a ordered before b
+typedef struct LinePair {
+  unsigned int a;
+  unsigned int b;
+} LinePair;
+
+// The parts of a line collision detection reads, packed together
+typedef struct LineScratch {
+  // Bounding box of the parallelogram the line sweeps this step, widened by
+  // SWEEP_MARGIN
+  Vec sweptMin;
+  Vec sweptMax;
+
+  Vec p1;
+  Vec p2;
+  Vec shift;
+  unsigned int id;
+} LineScratch;
+
 typedef struct Quadtree {
 
   // The CollisionWorld the Quadtree exists in
@@ -40,24 +93,49 @@ typedef struct Quadtree {
   
   unsigned int depth;
 
-  // Array containing all of the lines that are part of this level of the Quadtree
-  // This array is only comprehensive if the node is a leaf
+  // Depth of the tree's leaves, the same in every node
+  unsigned int leafDepth;
+
+  // True if the leaves are filled by LinearQuadtree_build rather than by
+  // each leaf scanning the lines
+  bool linear;
+
+  // Array containing all of the lines that are part of this leaf, drawn
+  // from the arena each frame and grown as needed.  NULL for internal nodes.
   Line** lines;
   unsigned int numOfLines;
 
-  // Array containing four quadrants of this Quadtree
-  Quadtree** quadrants;
+  // Size of the bucket; kept across frames, so a leaf that grew once starts
+  // the next frame at that size
+  unsigned int lineCapacity;
+
+  // Copies of lines[i] for collision detection, drawn from the arena
+  LineScratch* scratch;
+
+  // Per-frame storage for the buckets of the whole tree, owned by the root
+  Arena* arena;
+
+  // The four quadrants of this Quadtree, in the same node pool
+  Quadtree* quadrants[4];
   
-  // True if the Quadtree contains less than MAX_LINES_PER_NODE lines
+  // True if the Quadtree has no quadrants
   bool isLeaf;
+
+  // A leaf's Morton code, its bit in a Line's leafMask
+  unsigned int leafCode;
 } Quadtree_t;
 
 
 
-Quadtree* Quadtree_new(CollisionWorld* collisionWorld, Vec upperLeft, Vec lowerRight, Quadtree* parent);
+// Creates the root of a tree of depth collisionWorld->quadtreeDepth, with
+// every node taken from one pool.
+Quadtree* Quadtree_new(CollisionWorld* collisionWorld, Vec upperLeft, Vec lowerRight);
 
+// Deletes the whole tree.  Call only on the root.
 void Quadtree_delete(Quadtree* quadtree);
 
+// Refills the leaves below quadtree.  Last frame's buckets of the whole tree
+// are released first, so only one node is updated per frame.
 void Quadtree_update(Quadtree* quadtree);
 
 // Adds all lines in this quadtree
@@ -72,16 +150,101 @@ void divideTree(Quadtree* quadtree);
 // Finds all of the lines that should belong to this quadtree level and adds them
 void findLines(Quadtree* quadtree);
 
-// Adds the line to the quadtree structure
-bool addLine(Quadtree* quadtree, Line* line);
+// Adds the line to the quadtree structure, growing the bucket if it is full.
+void addLine(Quadtree* quadtree, Line* line);
 
 // Checks if the moving line is in the quadtree
 bool isLineInQuadtree(Quadtree* quadtree, Line* line);
 
+// Returns the leaves of the tree at root that line belongs to, as a
+// leafMask: the leaves isLineInQuadtree accepts, found by descending only
+// into quadrants the line overlaps.  The tree must be at most
+// QUADTREE_MASK_DEPTH deep.
+uint64_t Quadtree_leafMask(Quadtree* root, Line* line);
+
+// Returns the number of line pairs in the leaves below quadtree, the work
+// collision detection has before the broadphase.
+double Quadtree_numLeafPairs(Quadtree* quadtree);
+
+// How full the leaves were and how much work collision detection did in
+// the last call to detectCollisionsReducer.  Kept while the collision world
+// has a QuadtreeStats (see CollisionWorld_recordStats).
+typedef struct QuadtreeStats {
+  // Lines in each leaf, indexed by leafCode
+  unsigned int numLeaves;
+  unsigned int leafLines[QUADTREE_MAX_LEAVES];
+
+  // Lines in the collision world; the lines in the leaves add up to more
+  // when lines straddle leaf borders
+  unsigned int numOfLines;
+
+  // Pairs of lines sharing a leaf, those whose swept boxes overlap, those
+  // passing fastIntersect, and those intersect found colliding
+  unsigned long leafPairs;
+  unsigned long boxPairs;
+  unsigned long candidates;
+  unsigned long hits;
+
+  // Events for a pair already found in another leaf, removed before
+  // solving
+  unsigned long duplicates;
+} QuadtreeStats;
+
+// Prints stats as two lines, tagged with the frame they were taken in.
+void Quadtree_printStats(FILE* out, const QuadtreeStats* stats,
+                         unsigned int frame);
+
+#if defined(CLASSIFIER_STATS)
+// Counts of isLineInQuadtree's results, and of where the test it replaced
+// disagrees.  Built with CLASSIFIER_STATS=1; every test then runs both
+// classifiers and updates these atomically, so it is slow.
+typedef struct ClassifierStats {
+  unsigned long tests;
+  unsigned long members;
+  unsigned long legacyMembers;
+
+  // The legacy test put the line in a box it does not touch
+  unsigned long legacyFalsePositives;
+
+  // The legacy test missed a box the line touches
+  unsigned long legacyFalseNegatives;
+} ClassifierStats;
+
+extern ClassifierStats Quadtree_classifierStats;
+
+void Quadtree_printClassifierStats(FILE* out);
+#endif
+
 // Recursively finds all collisions in this quadtree, adds them to the eventList, 
 // and returns the number of collisions
 unsigned int detectCollisions(Quadtree* quadtree, IntersectionEventList* intersectionEventList);
 
-void detectCollisionsReducer(Quadtree* quadtree, IntersectionEventListReducer* intersectionEventList, CILK_C_REDUCER_OPADD_TYPE(int)* numCollisions);
+#if defined(PIPELINE_STATS)
+#include "fasttime.h"
+
+enum { BROADPHASE_STAGE, FAST_STAGE, INTERSECT_STAGE, NUM_PIPELINE_STAGES };
+
+// Work and time of each stage of collision detection, per worker.  Built
+// with PIPELINE_STATS=1.
+typedef struct PipelineStats {
+  // Pairs the broadphase looked at, passed on, and fastIntersect passed on
+  unsigned long scanned;
+  unsigned long pairs;
+  unsigned long candidates;
+  double seconds[NUM_PIPELINE_STAGES];
+
+  // When the running stage started
+  fasttime_t clock;
+} __attribute__((aligned(PARALLEL_CACHE_LINE))) PipelineStats;
+
+extern PipelineStats* Quadtree_pipelineStats;
+
+void Quadtree_printPipelineStats(FILE* out);
+
+// Frees the stats; the next detection starts them from zero.
+void Quadtree_deletePipelineStats();
+#endif
+
+void detectCollisionsReducer(Quadtree* quadtree, IntersectionEventListReducer* intersectionEventList, ParallelCounter* numCollisions);
 
 #endif  // QUADTREE_H_
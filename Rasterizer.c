@@ -0,0 +1,334 @@
+/**
+ * Rasterizer.c -- headless software rendering of the line simulation
+ *
+ * Function definitions in Rasterizer.h
+ **/
+
+#include "Rasterizer.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CollisionWorld.h"
+#include "Line.h"
+#include "Parallel.h"
+
+#define NUM_TILES_X ((WINDOW_WIDTH + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE)
+#define NUM_TILES_Y ((WINDOW_HEIGHT + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE)
+#define NUM_TILES (NUM_TILES_X * NUM_TILES_Y)
+
+// Palette, indexed by Color and then RASTER_BACKGROUND: the "dark red" and
+// "gray" used by the X11 renderer, on black.
+static const uint8_t paletteRGB[3][3] = {
+  { 139, 0, 0 },
+  { 190, 190, 190 },
+  { 0, 0, 0 }
+};
+
+// The same palette in full-range BT.601 YCbCr.
+static uint8_t paletteYUV[3][3];
+
+static void initPaletteYUV() {
+  for (int i = 0; i < 3; i++) {
+    double r = paletteRGB[i][0];
+    double g = paletteRGB[i][1];
+    double b = paletteRGB[i][2];
+    paletteYUV[i][0] = lrint(0.299 * r + 0.587 * g + 0.114 * b);
+    paletteYUV[i][1] = lrint(-0.168736 * r - 0.331264 * g + 0.5 * b + 128);
+    paletteYUV[i][2] = lrint(0.5 * r - 0.418688 * g - 0.081312 * b + 128);
+  }
+}
+
+RasterFormat Rasterizer_formatFromPath(const char* path) {
+  const char* extension = strrchr(path, '.');
+  if (extension != NULL && strcmp(extension, ".ppm") == 0) {
+    return RASTER_PPM;
+  }
+  if (extension != NULL && strcmp(extension, ".y4m") == 0) {
+    return RASTER_Y4M;
+  }
+  return RASTER_RAW;
+}
+
+Rasterizer* Rasterizer_new(const char* path, const RasterFormat format) {
+  Rasterizer* rasterizer = malloc(sizeof(Rasterizer));
+  if (rasterizer == NULL) {
+    return NULL;
+  }
+  rasterizer->fout = fopen(path, "wb");
+  if (rasterizer->fout == NULL) {
+    perror("Rasterizer: fopen");
+    free(rasterizer);
+    return NULL;
+  }
+  setvbuf(rasterizer->fout, NULL, _IOFBF, 1 << 22);
+
+  rasterizer->format = format;
+  rasterizer->framebuffer = malloc(WINDOW_WIDTH * WINDOW_HEIGHT);
+  if (format == RASTER_Y4M) {
+    rasterizer->outputSize = WINDOW_WIDTH * WINDOW_HEIGHT
+        + 2 * (WINDOW_WIDTH / 2) * (WINDOW_HEIGHT / 2);
+  } else {
+    rasterizer->outputSize = 3 * WINDOW_WIDTH * WINDOW_HEIGHT;
+  }
+  rasterizer->output = malloc(rasterizer->outputSize);
+  rasterizer->segments = NULL;
+  rasterizer->numSegments = 0;
+  rasterizer->segmentCapacity = 0;
+  rasterizer->tileCount = calloc(NUM_TILES, sizeof(unsigned int));
+  rasterizer->tileStart = malloc((NUM_TILES + 1) * sizeof(unsigned int));
+  rasterizer->binned = NULL;
+  rasterizer->binnedCapacity = 0;
+  rasterizer->numFrames = 0;
+
+  initPaletteYUV();
+  if (format == RASTER_Y4M) {
+    fprintf(rasterizer->fout, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+            WINDOW_WIDTH, WINDOW_HEIGHT, RASTER_FRAME_RATE);
+  }
+  return rasterizer;
+}
+
+void Rasterizer_delete(Rasterizer* rasterizer) {
+  fclose(rasterizer->fout);
+  free(rasterizer->framebuffer);
+  free(rasterizer->output);
+  free(rasterizer->segments);
+  free(rasterizer->tileCount);
+  free(rasterizer->tileStart);
+  free(rasterizer->binned);
+  free(rasterizer);
+}
+
+///////////////////////////////////////////////////////////
+// Rasterize the segments binned to one tile.  Pixels are sampled from
+// the segment's global equation, so segments crossing tile borders come
+// out the same as if the frame were drawn in one piece.
+static void drawTile(Rasterizer* rasterizer, int tile) {
+  int x0 = (tile % NUM_TILES_X) * RASTER_TILE_SIZE;
+  int y0 = (tile / NUM_TILES_X) * RASTER_TILE_SIZE;
+  int x1 = MIN(x0 + RASTER_TILE_SIZE, WINDOW_WIDTH);
+  int y1 = MIN(y0 + RASTER_TILE_SIZE, WINDOW_HEIGHT);
+  uint8_t* framebuffer = rasterizer->framebuffer;
+
+  for (int y = y0; y < y1; y++) {
+    memset(&framebuffer[y * WINDOW_WIDTH + x0], RASTER_BACKGROUND, x1 - x0);
+  }
+
+  unsigned int end = rasterizer->tileStart[tile + 1];
+  for (unsigned int i = rasterizer->tileStart[tile]; i < end; i++) {
+    RasterSegment* segment = &rasterizer->segments[rasterizer->binned[i]];
+    int ax = segment->x1;
+    int ay = segment->y1;
+    int bx = segment->x2;
+    int by = segment->y2;
+
+    int dx = bx - ax;
+    int dy = by - ay;
+    if (abs(dx) >= abs(dy)) {
+      if (dx == 0) {
+        // a single pixel, known to be in this tile
+        framebuffer[ay * WINDOW_WIDTH + ax] = segment->color;
+        continue;
+      }
+      double slope = (double) dy / dx;
+      int xStart = MAX(MIN(ax, bx), x0);
+      int xEnd = MIN(MAX(ax, bx), x1 - 1);
+      for (int x = xStart; x <= xEnd; x++) {
+        int y = ay + (int) floor((x - ax) * slope + 0.5);
+        if (y >= y0 && y < y1) {
+          framebuffer[y * WINDOW_WIDTH + x] = segment->color;
+        }
+      }
+    } else {
+      double slope = (double) dx / dy;
+      int yStart = MAX(MIN(ay, by), y0);
+      int yEnd = MIN(MAX(ay, by), y1 - 1);
+      for (int y = yStart; y <= yEnd; y++) {
+        int x = ax + (int) floor((y - ay) * slope + 0.5);
+        if (x >= x0 && x < x1) {
+          framebuffer[y * WINDOW_WIDTH + x] = segment->color;
+        }
+      }
+    }
+  }
+}
+
+static void drawTiles(void* context, int begin, int end) {
+  for (int tile = begin; tile < end; tile++) {
+    drawTile((Rasterizer*) context, tile);
+  }
+}
+
+typedef struct SegmentContext {
+  Rasterizer* rasterizer;
+  CollisionWorld* collisionWorld;
+} SegmentContext;
+
+// Convert box coordinates to window coordinates for lines [begin, end),
+// and count each line in the tiles its bounding box covers.
+static void convertSegments(void* context, int begin, int end) {
+  Rasterizer* rasterizer = ((SegmentContext*) context)->rasterizer;
+  RasterSegment* segments = rasterizer->segments;
+  CollisionWorld* collisionWorld = ((SegmentContext*) context)->collisionWorld;
+  for (int i = begin; i < end; i++) {
+    Line* line = collisionWorld->lines[i];
+    assert(line->id < collisionWorld->numOfLines);
+    window_dimension px1;
+    window_dimension py1;
+    window_dimension px2;
+    window_dimension py2;
+    boxToWindow(&px1, &py1, line->p1.x, line->p1.y);
+    boxToWindow(&px2, &py2, line->p2.x, line->p2.y);
+
+    // by ID, so lines are drawn in the same order however they are stored
+    RasterSegment* segment = &segments[line->id];
+    segment->x1 = (int16_t) px1;
+    segment->y1 = (int16_t) py1;
+    segment->x2 = (int16_t) px2;
+    segment->y2 = (int16_t) py2;
+    segment->color = line->color;
+
+    int minX = MIN(segment->x1, segment->x2);
+    int maxX = MAX(segment->x1, segment->x2);
+    int minY = MIN(segment->y1, segment->y2);
+    int maxY = MAX(segment->y1, segment->y2);
+    if (maxX < 0 || minX >= WINDOW_WIDTH || maxY < 0 || minY >= WINDOW_HEIGHT) {
+      segment->tileX0 = segment->tileY0 = 1;
+      segment->tileX1 = segment->tileY1 = 0;
+      continue;
+    }
+    segment->tileX0 = MAX(minX, 0) / RASTER_TILE_SIZE;
+    segment->tileY0 = MAX(minY, 0) / RASTER_TILE_SIZE;
+    segment->tileX1 = MIN(maxX, WINDOW_WIDTH - 1) / RASTER_TILE_SIZE;
+    segment->tileY1 = MIN(maxY, WINDOW_HEIGHT - 1) / RASTER_TILE_SIZE;
+    for (int ty = segment->tileY0; ty <= segment->tileY1; ty++) {
+      for (int tx = segment->tileX0; tx <= segment->tileX1; tx++) {
+        __sync_fetch_and_add(&rasterizer->tileCount[ty * NUM_TILES_X + tx], 1);
+      }
+    }
+  }
+}
+
+// Lay the bins out from the counts and fill them.  The fill walks the
+// segments in ID order, so each tile draws its segments in the order the
+// whole frame would, and overlapping pixels keep the same color.
+static void binSegments(Rasterizer* rasterizer) {
+  unsigned int* tileStart = rasterizer->tileStart;
+  tileStart[0] = 0;
+  for (int tile = 0; tile < NUM_TILES; tile++) {
+    tileStart[tile + 1] = tileStart[tile] + rasterizer->tileCount[tile];
+    rasterizer->tileCount[tile] = tileStart[tile];
+  }
+  if (tileStart[NUM_TILES] > rasterizer->binnedCapacity) {
+    rasterizer->binnedCapacity = 2 * tileStart[NUM_TILES];
+    free(rasterizer->binned);
+    rasterizer->binned = malloc(rasterizer->binnedCapacity
+                                * sizeof(unsigned int));
+    assert(rasterizer->binned != NULL);
+  }
+
+  // tileCount is the fill cursor of each bin from here
+  for (unsigned int id = 0; id < rasterizer->numSegments; id++) {
+    RasterSegment* segment = &rasterizer->segments[id];
+    for (int ty = segment->tileY0; ty <= segment->tileY1; ty++) {
+      for (int tx = segment->tileX0; tx <= segment->tileX1; tx++) {
+        rasterizer->binned[rasterizer->tileCount[ty * NUM_TILES_X + tx]++] = id;
+      }
+    }
+  }
+  memset(rasterizer->tileCount, 0, NUM_TILES * sizeof(unsigned int));
+}
+
+void Rasterizer_drawLines(Rasterizer* rasterizer,
+                          CollisionWorld* collisionWorld) {
+  unsigned int numOfLines = collisionWorld->numOfLines;
+  if (numOfLines > rasterizer->segmentCapacity) {
+    rasterizer->segmentCapacity = numOfLines;
+    rasterizer->segments = realloc(rasterizer->segments,
+                                   numOfLines * sizeof(RasterSegment));
+    assert(rasterizer->segments != NULL);
+  }
+  rasterizer->numSegments = numOfLines;
+
+  SegmentContext context = { rasterizer, collisionWorld };
+  Parallel_for(0, numOfLines, 0, convertSegments, &context);
+  binSegments(rasterizer);
+  Parallel_for(0, NUM_TILES, 1, drawTiles, rasterizer);
+}
+
+///////////////////////////////////////////////////////////
+// Expand palette indices to RGB, one row per iteration.
+static void convertRGBRows(void* context, int begin, int end) {
+  Rasterizer* rasterizer = (Rasterizer*) context;
+  uint8_t* framebuffer = rasterizer->framebuffer;
+  uint8_t* output = rasterizer->output;
+  for (int y = begin; y < end; y++) {
+    uint8_t* in = &framebuffer[y * WINDOW_WIDTH];
+    uint8_t* out = &output[3 * y * WINDOW_WIDTH];
+    for (int x = 0; x < WINDOW_WIDTH; x++) {
+      const uint8_t* rgb = paletteRGB[in[x]];
+      out[3 * x] = rgb[0];
+      out[3 * x + 1] = rgb[1];
+      out[3 * x + 2] = rgb[2];
+    }
+  }
+}
+
+static void convertRGB(Rasterizer* rasterizer) {
+  Parallel_for(0, WINDOW_HEIGHT, 0, convertRGBRows, rasterizer);
+}
+
+///////////////////////////////////////////////////////////
+// Expand palette indices to planar YUV 4:2:0, one pair of rows per
+// iteration.  Chroma is averaged over each 2x2 block.
+static void convertYUVRows(void* context, int begin, int end) {
+  Rasterizer* rasterizer = (Rasterizer*) context;
+  const int chromaWidth = WINDOW_WIDTH / 2;
+  const int chromaHeight = WINDOW_HEIGHT / 2;
+  uint8_t* framebuffer = rasterizer->framebuffer;
+  uint8_t* planeY = rasterizer->output;
+  uint8_t* planeU = planeY + WINDOW_WIDTH * WINDOW_HEIGHT;
+  uint8_t* planeV = planeU + chromaWidth * chromaHeight;
+
+  for (int cy = begin; cy < end; cy++) {
+    uint8_t* row0 = &framebuffer[2 * cy * WINDOW_WIDTH];
+    uint8_t* row1 = row0 + WINDOW_WIDTH;
+    for (int x = 0; x < WINDOW_WIDTH; x++) {
+      planeY[2 * cy * WINDOW_WIDTH + x] = paletteYUV[row0[x]][0];
+      planeY[(2 * cy + 1) * WINDOW_WIDTH + x] = paletteYUV[row1[x]][0];
+    }
+    for (int cx = 0; cx < chromaWidth; cx++) {
+      const uint8_t* p00 = paletteYUV[row0[2 * cx]];
+      const uint8_t* p01 = paletteYUV[row0[2 * cx + 1]];
+      const uint8_t* p10 = paletteYUV[row1[2 * cx]];
+      const uint8_t* p11 = paletteYUV[row1[2 * cx + 1]];
+      planeU[cy * chromaWidth + cx] = (p00[1] + p01[1] + p10[1] + p11[1] + 2) / 4;
+      planeV[cy * chromaWidth + cx] = (p00[2] + p01[2] + p10[2] + p11[2] + 2) / 4;
+    }
+  }
+}
+
+static void convertYUV(Rasterizer* rasterizer) {
+  Parallel_for(0, WINDOW_HEIGHT / 2, 0, convertYUVRows, rasterizer);
+}
+
+void Rasterizer_writeFrame(Rasterizer* rasterizer) {
+  switch (rasterizer->format) {
+    case RASTER_PPM:
+      fprintf(rasterizer->fout, "P6\n%d %d\n255\n", WINDOW_WIDTH, WINDOW_HEIGHT);
+      convertRGB(rasterizer);
+      break;
+    case RASTER_Y4M:
+      fputs("FRAME\n", rasterizer->fout);
+      convertYUV(rasterizer);
+      break;
+    case RASTER_RAW:
+      convertRGB(rasterizer);
+      break;
+  }
+  fwrite(rasterizer->output, 1, rasterizer->outputSize, rasterizer->fout);
+  rasterizer->numFrames++;
+}
@@ -0,0 +1,90 @@
+/**
+ * Rasterizer.h -- headless software rendering of the line simulation
+ *
+ * Renders frames into an in-memory framebuffer at WINDOW_WIDTH x
+ * WINDOW_HEIGHT and streams them out as raw RGB, binary PPM or YUV4MPEG2,
+ * without needing an X display.  The framebuffer is split into tiles that
+ * are rasterized in parallel.
+ **/
+
+#ifndef RASTERIZER_H_
+#define RASTERIZER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "CollisionWorld.h"
+#include "Line.h"
+
+#define RASTER_TILE_SIZE 64
+#define RASTER_FRAME_RATE 60
+
+// Background pixels, followed by one palette entry per Color.
+#define RASTER_BACKGROUND 2
+
+typedef enum {
+  RASTER_RAW,  // Packed 24-bit RGB, no headers
+  RASTER_PPM,  // One binary PPM (P6) image per frame
+  RASTER_Y4M   // YUV4MPEG2, 4:2:0
+} RasterFormat;
+
+// A line in window coordinates.
+typedef struct RasterSegment {
+  int16_t x1;
+  int16_t y1;
+  int16_t x2;
+  int16_t y2;
+  Color color;
+
+  // The tiles its bounding box covers, inclusive; empty (tileX0 > tileX1)
+  // if it is off screen.
+  int16_t tileX0;
+  int16_t tileY0;
+  int16_t tileX1;
+  int16_t tileY1;
+} RasterSegment;
+
+typedef struct Rasterizer {
+  RasterFormat format;
+  FILE* fout;
+
+  // One palette index per pixel, row-major.
+  uint8_t* framebuffer;
+
+  // The frame converted to the output format.
+  uint8_t* output;
+  size_t outputSize;
+
+  // Every line in window coordinates, rebuilt every frame.
+  RasterSegment* segments;
+  unsigned int numSegments;
+  unsigned int segmentCapacity;
+
+  // Segment IDs binned by tile, in ID order: tile t draws
+  // binned[tileStart[t]..tileStart[t + 1]).  tileCount is filled while the
+  // segments are converted.
+  unsigned int* tileCount;
+  unsigned int* tileStart;
+  unsigned int* binned;
+  unsigned int binnedCapacity;
+
+  unsigned int numFrames;
+} Rasterizer;
+
+// Picks the format from the file extension (.ppm, .y4m, anything else is
+// raw RGB).
+RasterFormat Rasterizer_formatFromPath(const char* path);
+
+// Returns NULL if path cannot be opened for writing.
+Rasterizer* Rasterizer_new(const char* path, const RasterFormat format);
+
+void Rasterizer_delete(Rasterizer* rasterizer);
+
+// Draws all lines of the collision world into the framebuffer.
+void Rasterizer_drawLines(Rasterizer* rasterizer,
+                          CollisionWorld* collisionWorld);
+
+// Converts the framebuffer and appends it to the output stream.
+void Rasterizer_writeFrame(Rasterizer* rasterizer);
+
+#endif  // RASTERIZER_H_
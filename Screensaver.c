@@ -26,10 +26,13 @@
 
 #include "fasttime.h"
 #include "Line.h"
+#include "Domain.h"
+#include "Ensemble.h"
 #include "LineDemo.h"
+#include "Rasterizer.h"
 
 // The PROFILE_BUILD preprocessor define is used to indicate we are building for
-// profiling, so don't include any graphics or Cilk functions.
+// profiling, so don't include any graphics functions.
 #ifndef PROFILE_BUILD
 #include "GraphicStuff.h"
 #endif
@@ -44,17 +47,62 @@ void lineMain(LineDemo *lineDemo) {
   }
 }
 
+// For headless video output
+void rasterMain(LineDemo *lineDemo, Rasterizer *rasterizer,
+                bool imageOnlyFlag) {
+  while (true) {
+    Rasterizer_drawLines(rasterizer, lineDemo->collisionWorld);
+    Rasterizer_writeFrame(rasterizer);
+    if (imageOnlyFlag || !LineDemo_update(lineDemo)) {
+      break;
+    }
+  }
+}
+
+// For ensembles of independent simulations
+int ensembleMain(const char *manifestPath) {
+  Ensemble *ensemble = Ensemble_new(manifestPath);
+  if (ensemble == NULL) {
+    return -1;
+  }
+
+  const fasttime_t start_time = gettime();
+  Ensemble_run(ensemble);
+  const fasttime_t end_time = gettime();
+
+  Ensemble_printResults(ensemble);
+  printf("Elapsed execution time: %fs for %u scenes\n",
+         tdiff(start_time, end_time), ensemble->numOfScenes);
+  Ensemble_delete(ensemble);
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
   int optchar;
 #ifndef PROFILE_BUILD
   bool graphicDemoFlag = false;
+  bool doubleBufferFlag = false;
+  bool pipelineFlag = false;
 #endif
   bool imageOnlyFlag = false;
   unsigned int numFrames = 1;
+  char *checkpointPath = NULL;
+  unsigned int checkpointInterval = 0;
+  char *restorePath = NULL;
+  char *trajectoryPath = NULL;
+  bool compressTrajectory = false;
+  char *videoPath = NULL;
+  char *ensemblePath = NULL;
+  char *dumpPath = NULL;
+  unsigned int numRanks = 0;
+  bool numaFlag = false;
+  bool autotuneFlag = false;
+  bool adaptiveFlag = false;
+  unsigned int statsInterval = 0;
   extern int optind;
 
   // Process command line options.
-  while ((optchar = getopt(argc, argv, "gi")) != -1) {
+  while ((optchar = getopt(argc, argv, "gidpc:k:r:t:zT:o:e:m:navs:")) != -1) {
     switch (optchar) {
       case 'g':
 #ifndef PROFILE_BUILD
@@ -67,12 +115,70 @@ int main(int argc, char *argv[]) {
         graphicDemoFlag = true;
 #endif
         break;
+      case 'd':
+#ifndef PROFILE_BUILD
+        doubleBufferFlag = true;
+        graphicDemoFlag = true;
+#endif
+        break;
+      case 'p':
+#ifndef PROFILE_BUILD
+        pipelineFlag = true;
+        graphicDemoFlag = true;
+#endif
+        break;
+      case 'c':
+        checkpointPath = optarg;
+        break;
+      case 'k':
+        checkpointInterval = atoi(optarg);
+        break;
+      case 'r':
+        restorePath = optarg;
+        break;
+      case 't':
+        trajectoryPath = optarg;
+        break;
+      case 'z':
+        compressTrajectory = true;
+        break;
+      case 'T':
+        dumpPath = optarg;
+        break;
+      case 'o':
+        videoPath = optarg;
+        break;
+      case 'e':
+        ensemblePath = optarg;
+        break;
+      case 'm':
+        numRanks = atoi(optarg);
+        break;
+      case 'n':
+        numaFlag = true;
+        break;
+      case 'a':
+        autotuneFlag = true;
+        break;
+      case 'v':
+        adaptiveFlag = true;
+        break;
+      case 's':
+        statsInterval = atoi(optarg);
+        break;
       default:
         printf("Ignoring unrecognized option: %c\n", optchar);
         continue;
     }
   }
 
+  if (ensemblePath != NULL) {
+    return ensembleMain(ensemblePath);
+  }
+  if (dumpPath != NULL) {
+    return TrajectoryReader_dump(dumpPath, stdout) ? 0 : -1;
+  }
+
   if (!imageOnlyFlag) {
     // Shift remaining arguments over.
     int remaining_args = argc - optind;
@@ -82,9 +188,36 @@ int main(int argc, char *argv[]) {
 
     // Check to make sure number of arguments is correct.
     if (remaining_args != 1) {
-      printf("Usage: %s [-g] [-i] <numFrames>\n", argv[0]);
+      printf("Usage: %s [-g] [-i] [-d] [-p] [-c <file> [-k <n>]] [-r <file>] "
+             "[-t <file> [-z]] [-o <file>] [-n] [-a] [-v] [-s <n>] "
+             "<numFrames>\n", argv[0]);
+      printf("       %s -m <processes> <numFrames>\n", argv[0]);
+      printf("       %s -e <manifest>\n", argv[0]);
+      printf("       %s -T <file>\n", argv[0]);
       printf("  -g : show graphics\n");
       printf("  -i : show first image only (ignore numFrames)\n");
+      printf("  -d : show graphics, double buffered\n");
+      printf("  -p : show graphics, drawing while the next frame is "
+             "simulated\n");
+      printf("  -c : write a snapshot to <file> at the end of the run\n");
+      printf("  -k : also write the snapshot every <n> frames\n");
+      printf("  -r : resume from the snapshot in <file>\n");
+      printf("  -t : record line positions and collisions to <file>\n");
+      printf("  -z : compress the recording (needs a ZLIB=1 build)\n");
+      printf("  -T : print the frames recorded in <file> with -t\n");
+      printf("  -o : render frames to <file> without a display "
+             "(.ppm, .y4m or raw RGB)\n");
+      printf("  -e : run every scene listed in <manifest> "
+             "(lines of: <file> <numFrames> [timeStep])\n");
+      printf("  -n : place lines and pin workers by NUMA node\n");
+      printf("  -a : tune the quadtree and grain size on the running scene, "
+             "logging picks to stderr\n");
+      printf("  -v : step up to %d frames at once while nothing can collide "
+             "(not with -g, -o or -t)\n", ADAPTIVE_MAX_FRAMES);
+      printf("  -s : print quadtree occupancy and pair work to stderr every "
+             "<n> frames\n");
+      printf("  -m : split the box across <processes> processes "
+             "(1, 4 or 16)\n");
       exit(-1);
     }
 
@@ -92,26 +225,87 @@ int main(int argc, char *argv[]) {
     printf("Number of frames = %u\n", numFrames);
   }
 
+  if (numRanks > 0) {
+    return Domain_main(numRanks, numFrames);
+  }
+
   // Create and initialize the Line simulation environment.
   LineDemo *lineDemo = LineDemo_new();
-  LineDemo_initLine(lineDemo);
+  if (restorePath != NULL) {
+    if (!LineDemo_restore(lineDemo, restorePath)) {
+      exit(-1);
+    }
+    printf("Resuming from frame %u\n", lineDemo->count);
+  } else {
+    LineDemo_initLine(lineDemo);
+  }
   LineDemo_setNumFrames(lineDemo, numFrames);
+  if (numaFlag) {
+    LineDemo_setNumaPlacement(lineDemo, NumaPlacement_new());
+  }
+  if (autotuneFlag) {
+    LineDemo_setAutotuner(lineDemo,
+                          Autotuner_new(lineDemo->collisionWorld, stderr));
+  }
+  if (statsInterval > 0) {
+    LineDemo_setStatsDump(lineDemo, stderr, statsInterval);
+  }
+  if (checkpointPath != NULL) {
+    LineDemo_setCheckpoint(lineDemo,
+                           Checkpoint_new(checkpointPath, checkpointInterval));
+  }
+  if (trajectoryPath != NULL) {
+    TrajectoryWriter* trajectoryWriter = TrajectoryWriter_new(trajectoryPath,
+        LineDemo_getNumOfLines(lineDemo), compressTrajectory);
+    if (trajectoryWriter == NULL) {
+      exit(-1);
+    }
+    LineDemo_setTrajectoryWriter(lineDemo, trajectoryWriter);
+  }
+
+  Rasterizer *rasterizer = NULL;
+  if (videoPath != NULL) {
+    rasterizer = Rasterizer_new(videoPath, Rasterizer_formatFromPath(videoPath));
+    if (rasterizer == NULL) {
+      exit(-1);
+    }
+  }
+
+  // drawn frames stay a fixed time step apart
+  bool drawing = rasterizer != NULL;
+#ifndef PROFILE_BUILD
+  drawing = drawing || graphicDemoFlag;
+#endif
+  if (adaptiveFlag && !drawing) {
+    LineDemo_setMaxStepFrames(lineDemo, ADAPTIVE_MAX_FRAMES);
+  }
 
   const fasttime_t start_time = gettime();
 
+  if (rasterizer != NULL) {
+    rasterMain(lineDemo, rasterizer, imageOnlyFlag);
+  }
 #ifndef PROFILE_BUILD
   // Run demo.
-  if (graphicDemoFlag) {
-    graphicMain(argc, argv, lineDemo, imageOnlyFlag);
+  else if (graphicDemoFlag) {
+    graphicMain(argc, argv, lineDemo, imageOnlyFlag, doubleBufferFlag,
+                pipelineFlag);
   } else {
     lineMain(lineDemo);
   }
 #else
-  lineMain(lineDemo);
+  else {
+    lineMain(lineDemo);
+  }
 #endif
 
   const fasttime_t end_time = gettime();
 
+  if (lineDemo->checkpoint != NULL) {
+    Checkpoint_save(lineDemo->checkpoint, lineDemo->collisionWorld,
+                    lineDemo->count);
+  }
+
   // Output results.
   printf("---- RESULTS ----\n");
   printf("Elapsed execution time: %fs\n",
@@ -121,9 +315,26 @@ int main(int argc, char *argv[]) {
   printf("%u Line-Line Collisions\n",
          LineDemo_getNumLineLineCollisions(lineDemo));
   printf("---- END RESULTS ----\n");
+#if defined(CLASSIFIER_STATS)
+  Quadtree_printClassifierStats(stdout);
+#endif
+#if defined(PIPELINE_STATS)
+  Quadtree_printPipelineStats(stdout);
+  Quadtree_deletePipelineStats();
+#endif
+
+  // a recording cut short by a write error fails the run
+  bool recorded = true;
+  if (lineDemo->trajectoryWriter != NULL) {
+    recorded = TrajectoryWriter_delete(lineDemo->trajectoryWriter);
+    lineDemo->trajectoryWriter = NULL;
+  }
 
   // delete objects
+  if (rasterizer != NULL) {
+    Rasterizer_delete(rasterizer);
+  }
   LineDemo_delete(lineDemo);
 
-  return 0;
+  return recorded ? 0 : -1;
 }
@@ -0,0 +1,535 @@
+/**
+ * TrajectoryWriter.c -- record line positions and collision events per frame
+ *
+ * Function definitions in TrajectoryWriter.h
+ **/
+
+#include "TrajectoryWriter.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "CollisionWorld.h"
+#include "Line.h"
+#include "Parallel.h"
+
+// Longest varint encoding of a 32-bit value.
+#define MAX_VARINT_BYTES 5
+
+static inline uint8_t* putU32(uint8_t* out, uint32_t value) {
+  out[0] = value;
+  out[1] = value >> 8;
+  out[2] = value >> 16;
+  out[3] = value >> 24;
+  return out + 4;
+}
+
+static inline uint8_t* putVarint(uint8_t* out, uint32_t value) {
+  while (value >= 0x80) {
+    *out++ = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  *out++ = value;
+  return out;
+}
+
+// Maps signed deltas to unsigned so small magnitudes stay short.
+static inline uint32_t zigzag(int32_t value) {
+  return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static inline int32_t quantize(double value, double origin) {
+  return (int32_t) lrint((value - origin) * TRAJECTORY_QUANT_SCALE);
+}
+
+static inline uint32_t getU32(const uint8_t* in) {
+  return in[0] | (uint32_t) in[1] << 8 | (uint32_t) in[2] << 16
+      | (uint32_t) in[3] << 24;
+}
+
+// Returns NULL if the varint runs past end.
+static inline const uint8_t* getVarint(const uint8_t* in, const uint8_t* end,
+                                       uint32_t* value) {
+  *value = 0;
+  for (int shift = 0; in < end && shift < 7 * MAX_VARINT_BYTES; shift += 7) {
+    uint8_t byte = *in++;
+    *value |= (uint32_t) (byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      return in;
+    }
+  }
+  return NULL;
+}
+
+static inline int32_t unzigzag(uint32_t value) {
+  return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+static bool writeU32s(FILE* fout, uint32_t* values, int count) {
+  uint8_t bytes[4 * count];
+  uint8_t* out = bytes;
+  for (int i = 0; i < count; i++) {
+    out = putU32(out, values[i]);
+  }
+  return fwrite(bytes, 1, sizeof(bytes), fout) == sizeof(bytes);
+}
+
+///////////////////////////////////////////////////////////
+// Encode one frame into trajectoryWriter->payload and append it to the file.
+// After the first failed write the frames are dropped: the deltas of later
+// ones would not decode without it.
+static void writeFrame(TrajectoryWriter* trajectoryWriter,
+                       TrajectoryFrame* frame) {
+  if (trajectoryWriter->failed) {
+    return;
+  }
+  unsigned int numOfLines = trajectoryWriter->numOfLines;
+  bool keyframe =
+      trajectoryWriter->framesWritten % TRAJECTORY_KEYFRAME_INTERVAL == 0;
+
+  size_t bound = (4 * numOfLines + 2 * frame->numEvents) * MAX_VARINT_BYTES
+      + frame->numEvents;
+  if (bound > trajectoryWriter->payloadCapacity) {
+    trajectoryWriter->payloadCapacity = 2 * bound;
+    trajectoryWriter->payload = realloc(trajectoryWriter->payload,
+                                        trajectoryWriter->payloadCapacity);
+    assert(trajectoryWriter->payload != NULL);
+  }
+
+  uint8_t* out = trajectoryWriter->payload;
+  int32_t* previous = trajectoryWriter->previous;
+  for (int i = 0; i < 2 * numOfLines; i++) {
+    int32_t x = quantize(frame->positions[i].x, BOX_XMIN);
+    int32_t y = quantize(frame->positions[i].y, BOX_YMIN);
+    int32_t dx = keyframe ? x : x - previous[2 * i];
+    int32_t dy = keyframe ? y : y - previous[2 * i + 1];
+    out = putVarint(out, zigzag(dx));
+    out = putVarint(out, zigzag(dy));
+    previous[2 * i] = x;
+    previous[2 * i + 1] = y;
+  }
+  for (int i = 0; i < frame->numEvents; i++) {
+    CollisionEvent* event = &frame->events[i];
+    out = putVarint(out, event->id1);
+    out = putVarint(out, event->id2 - event->id1);
+    *out++ = (uint8_t) event->intersectionType;
+  }
+
+  uint8_t* stored = trajectoryWriter->payload;
+  uint32_t rawSize = out - trajectoryWriter->payload;
+  uint32_t storedSize = rawSize;
+#ifdef HAVE_ZLIB
+  if (trajectoryWriter->compress) {
+    uLongf compressedSize = compressBound(rawSize);
+    if (compressedSize > trajectoryWriter->compressedCapacity) {
+      trajectoryWriter->compressedCapacity = 2 * compressedSize;
+      trajectoryWriter->compressed = realloc(trajectoryWriter->compressed,
+          trajectoryWriter->compressedCapacity);
+      assert(trajectoryWriter->compressed != NULL);
+    }
+    if (compress2(trajectoryWriter->compressed, &compressedSize,
+                  trajectoryWriter->payload, rawSize, Z_BEST_SPEED) == Z_OK
+        && compressedSize < rawSize) {
+      stored = trajectoryWriter->compressed;
+      storedSize = compressedSize;
+    }
+  }
+#endif
+
+  uint32_t record[5] = {
+    frame->frame,
+    keyframe ? TRAJECTORY_KEYFRAME : 0,
+    frame->numEvents,
+    rawSize,
+    storedSize
+  };
+  if (!writeU32s(trajectoryWriter->fout, record, 5)
+      || fwrite(stored, 1, storedSize, trajectoryWriter->fout) != storedSize) {
+    perror("TrajectoryWriter: fwrite");
+    trajectoryWriter->failed = true;
+    return;
+  }
+  trajectoryWriter->framesWritten++;
+}
+
+///////////////////////////////////////////////////////////
+// Writer thread: drain the ring until the simulation is done.
+static void* writerMain(void* arg) {
+  TrajectoryWriter* trajectoryWriter = (TrajectoryWriter*) arg;
+
+  pthread_mutex_lock(&trajectoryWriter->lock);
+  while (true) {
+    while (trajectoryWriter->numQueued == 0 && !trajectoryWriter->done) {
+      pthread_cond_wait(&trajectoryWriter->notEmpty, &trajectoryWriter->lock);
+    }
+    if (trajectoryWriter->numQueued == 0) {
+      break;
+    }
+    TrajectoryFrame* frame = &trajectoryWriter->ring[trajectoryWriter->head];
+    pthread_mutex_unlock(&trajectoryWriter->lock);
+
+    writeFrame(trajectoryWriter, frame);
+
+    pthread_mutex_lock(&trajectoryWriter->lock);
+    trajectoryWriter->head = (trajectoryWriter->head + 1) % TRAJECTORY_RING_SIZE;
+    trajectoryWriter->numQueued--;
+    pthread_cond_signal(&trajectoryWriter->notFull);
+  }
+  pthread_mutex_unlock(&trajectoryWriter->lock);
+  return NULL;
+}
+
+TrajectoryWriter* TrajectoryWriter_new(const char* path,
+                                       const unsigned int numOfLines,
+                                       const bool compress) {
+  assert(numOfLines > 0);
+
+  TrajectoryWriter* trajectoryWriter = malloc(sizeof(TrajectoryWriter));
+  if (trajectoryWriter == NULL) {
+    return NULL;
+  }
+  trajectoryWriter->fout = fopen(path, "wb");
+  if (trajectoryWriter->fout == NULL) {
+    perror("TrajectoryWriter: fopen");
+    free(trajectoryWriter);
+    return NULL;
+  }
+  setvbuf(trajectoryWriter->fout, NULL, _IOFBF, 1 << 20);
+
+  trajectoryWriter->numOfLines = numOfLines;
+  trajectoryWriter->compress = compress;
+#ifndef HAVE_ZLIB
+  if (compress) {
+    fprintf(stderr, "TrajectoryWriter: built without zlib, "
+                    "writing uncompressed\n");
+    trajectoryWriter->compress = false;
+  }
+#endif
+
+  // preallocate the ring
+  for (int i = 0; i < TRAJECTORY_RING_SIZE; i++) {
+    TrajectoryFrame* frame = &trajectoryWriter->ring[i];
+    frame->positions = malloc(2 * numOfLines * sizeof(Vec));
+    frame->eventCapacity = 64;
+    frame->events = malloc(frame->eventCapacity * sizeof(CollisionEvent));
+    frame->numEvents = 0;
+  }
+  trajectoryWriter->head = 0;
+  trajectoryWriter->tail = 0;
+  trajectoryWriter->numQueued = 0;
+  trajectoryWriter->done = false;
+
+  trajectoryWriter->previous = calloc(4 * numOfLines, sizeof(int32_t));
+  trajectoryWriter->payload = NULL;
+  trajectoryWriter->payloadCapacity = 0;
+  trajectoryWriter->compressed = NULL;
+  trajectoryWriter->compressedCapacity = 0;
+  trajectoryWriter->framesWritten = 0;
+  trajectoryWriter->failed = false;
+
+  uint32_t header[5] = {
+    TRAJECTORY_MAGIC,
+    TRAJECTORY_VERSION,
+    numOfLines,
+    trajectoryWriter->compress ? TRAJECTORY_COMPRESSED : 0,
+    TRAJECTORY_QUANT_SCALE
+  };
+  if (!writeU32s(trajectoryWriter->fout, header, 5)) {
+    perror("TrajectoryWriter: fwrite");
+    trajectoryWriter->failed = true;
+  }
+
+  pthread_mutex_init(&trajectoryWriter->lock, NULL);
+  pthread_cond_init(&trajectoryWriter->notEmpty, NULL);
+  pthread_cond_init(&trajectoryWriter->notFull, NULL);
+  pthread_create(&trajectoryWriter->writer, NULL, writerMain, trajectoryWriter);
+  return trajectoryWriter;
+}
+
+bool TrajectoryWriter_delete(TrajectoryWriter* trajectoryWriter) {
+  pthread_mutex_lock(&trajectoryWriter->lock);
+  trajectoryWriter->done = true;
+  pthread_cond_signal(&trajectoryWriter->notEmpty);
+  pthread_mutex_unlock(&trajectoryWriter->lock);
+  pthread_join(trajectoryWriter->writer, NULL);
+
+  // buffered frames only reach the file here
+  bool written = !trajectoryWriter->failed;
+  if (fclose(trajectoryWriter->fout) != 0 && written) {
+    perror("TrajectoryWriter: fclose");
+    written = false;
+  }
+  pthread_mutex_destroy(&trajectoryWriter->lock);
+  pthread_cond_destroy(&trajectoryWriter->notEmpty);
+  pthread_cond_destroy(&trajectoryWriter->notFull);
+  for (int i = 0; i < TRAJECTORY_RING_SIZE; i++) {
+    free(trajectoryWriter->ring[i].positions);
+    free(trajectoryWriter->ring[i].events);
+  }
+  free(trajectoryWriter->previous);
+  free(trajectoryWriter->payload);
+  free(trajectoryWriter->compressed);
+  free(trajectoryWriter);
+  return written;
+}
+
+typedef struct PositionContext {
+  CollisionWorld* collisionWorld;
+  Vec* positions;
+  unsigned int numOfLines;
+} PositionContext;
+
+// Copy the endpoints of lines [begin, end), indexed by line ID.
+static void copyPositions(void* context, int begin, int end) {
+  PositionContext* positionContext = (PositionContext*) context;
+  for (int i = begin; i < end; i++) {
+    Line* line = positionContext->collisionWorld->lines[i];
+    assert(line->id < positionContext->numOfLines);
+    positionContext->positions[2 * line->id] = line->p1;
+    positionContext->positions[2 * line->id + 1] = line->p2;
+  }
+}
+
+void TrajectoryWriter_record(TrajectoryWriter* trajectoryWriter,
+                             CollisionWorld* collisionWorld,
+                             const unsigned int frame) {
+  // wait for a free buffer
+  pthread_mutex_lock(&trajectoryWriter->lock);
+  while (trajectoryWriter->numQueued == TRAJECTORY_RING_SIZE) {
+    pthread_cond_wait(&trajectoryWriter->notFull, &trajectoryWriter->lock);
+  }
+  TrajectoryFrame* slot = &trajectoryWriter->ring[trajectoryWriter->tail];
+  pthread_mutex_unlock(&trajectoryWriter->lock);
+
+  // copy the frame; the slot belongs to us until it is queued
+  slot->frame = frame;
+  PositionContext context = { collisionWorld, slot->positions,
+                              trajectoryWriter->numOfLines };
+  Parallel_for(0, collisionWorld->numOfLines, 0, copyPositions, &context);
+  if (collisionWorld->numEvents > slot->eventCapacity) {
+    slot->eventCapacity = 2 * collisionWorld->numEvents;
+    slot->events = realloc(slot->events,
+                           slot->eventCapacity * sizeof(CollisionEvent));
+    assert(slot->events != NULL);
+  }
+  if (collisionWorld->numEvents > 0) {
+    memcpy(slot->events, collisionWorld->events,
+           collisionWorld->numEvents * sizeof(CollisionEvent));
+  }
+  slot->numEvents = collisionWorld->numEvents;
+
+  pthread_mutex_lock(&trajectoryWriter->lock);
+  trajectoryWriter->tail = (trajectoryWriter->tail + 1) % TRAJECTORY_RING_SIZE;
+  trajectoryWriter->numQueued++;
+  pthread_cond_signal(&trajectoryWriter->notEmpty);
+  pthread_mutex_unlock(&trajectoryWriter->lock);
+}
+
+static bool readU32s(FILE* fin, uint32_t* values, int count) {
+  uint8_t bytes[4 * count];
+  if (fread(bytes, 1, sizeof(bytes), fin) != sizeof(bytes)) {
+    return false;
+  }
+  for (int i = 0; i < count; i++) {
+    values[i] = getU32(&bytes[4 * i]);
+  }
+  return true;
+}
+
+TrajectoryReader* TrajectoryReader_new(const char* path) {
+  FILE* fin = fopen(path, "rb");
+  if (fin == NULL) {
+    perror(path);
+    return NULL;
+  }
+  uint32_t header[5];
+  if (!readU32s(fin, header, 5) || header[0] != TRAJECTORY_MAGIC
+      || header[1] != TRAJECTORY_VERSION || header[2] == 0
+      || header[4] != TRAJECTORY_QUANT_SCALE) {
+    fprintf(stderr, "%s: not a trajectory stream of version %d\n", path,
+            TRAJECTORY_VERSION);
+    fclose(fin);
+    return NULL;
+  }
+#ifndef HAVE_ZLIB
+  if (header[3] & TRAJECTORY_COMPRESSED) {
+    fprintf(stderr, "%s: compressed; rebuild with ZLIB=1 to read it\n", path);
+    fclose(fin);
+    return NULL;
+  }
+#endif
+
+  TrajectoryReader* trajectoryReader = malloc(sizeof(TrajectoryReader));
+  if (trajectoryReader == NULL) {
+    fclose(fin);
+    return NULL;
+  }
+  trajectoryReader->fin = fin;
+  trajectoryReader->numOfLines = header[2];
+  trajectoryReader->flags = header[3];
+  trajectoryReader->atEnd = false;
+  trajectoryReader->previous = calloc(4 * header[2], sizeof(int32_t));
+  trajectoryReader->payload = NULL;
+  trajectoryReader->payloadCapacity = 0;
+  trajectoryReader->stored = NULL;
+  trajectoryReader->storedCapacity = 0;
+  return trajectoryReader;
+}
+
+void TrajectoryReader_delete(TrajectoryReader* trajectoryReader) {
+  fclose(trajectoryReader->fin);
+  free(trajectoryReader->previous);
+  free(trajectoryReader->payload);
+  free(trajectoryReader->stored);
+  free(trajectoryReader);
+}
+
+// Make buffer hold at least size bytes.
+static bool reserve(uint8_t** buffer, size_t* capacity, size_t size) {
+  if (size > *capacity) {
+    uint8_t* grown = realloc(*buffer, size);
+    if (grown == NULL) {
+      return false;
+    }
+    *buffer = grown;
+    *capacity = size;
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////
+// Inflate the payload if it was stored deflated, then undo writeFrame's
+// encoding: deltas against the last frame, or absolute on keyframes.
+bool TrajectoryReader_next(TrajectoryReader* trajectoryReader,
+                           TrajectoryFrame* frame) {
+  uint8_t bytes[20];
+  size_t got = fread(bytes, 1, sizeof(bytes), trajectoryReader->fin);
+  if (got != sizeof(bytes)) {
+    // a damaged stream may end partway into a record
+    trajectoryReader->atEnd = got == 0 && feof(trajectoryReader->fin);
+    return false;
+  }
+  uint32_t record[5];
+  for (int i = 0; i < 5; i++) {
+    record[i] = getU32(&bytes[4 * i]);
+  }
+  const bool keyframe = record[1] & TRAJECTORY_KEYFRAME;
+  const uint32_t numEvents = record[2];
+  const uint32_t rawSize = record[3];
+  const uint32_t storedSize = record[4];
+  if (storedSize > rawSize
+      || !reserve(&trajectoryReader->payload,
+                  &trajectoryReader->payloadCapacity, rawSize)) {
+    return false;
+  }
+
+  if (storedSize == rawSize) {
+    if (fread(trajectoryReader->payload, 1, rawSize,
+              trajectoryReader->fin) != rawSize) {
+      return false;
+    }
+  } else {
+#ifdef HAVE_ZLIB
+    if (!reserve(&trajectoryReader->stored, &trajectoryReader->storedCapacity,
+                 storedSize)
+        || fread(trajectoryReader->stored, 1, storedSize,
+                 trajectoryReader->fin) != storedSize) {
+      return false;
+    }
+    uLongf inflatedSize = rawSize;
+    if (uncompress(trajectoryReader->payload, &inflatedSize,
+                   trajectoryReader->stored, storedSize) != Z_OK
+        || inflatedSize != rawSize) {
+      return false;
+    }
+#else
+    return false;
+#endif
+  }
+
+  const uint8_t* in = trajectoryReader->payload;
+  const uint8_t* end = in + rawSize;
+  int32_t* previous = trajectoryReader->previous;
+  for (int i = 0; i < 4 * trajectoryReader->numOfLines; i++) {
+    uint32_t value;
+    in = getVarint(in, end, &value);
+    if (in == NULL) {
+      return false;
+    }
+    previous[i] = keyframe ? unzigzag(value) : previous[i] + unzigzag(value);
+  }
+  for (int i = 0; i < 2 * trajectoryReader->numOfLines; i++) {
+    frame->positions[i].x =
+        (double) previous[2 * i] / TRAJECTORY_QUANT_SCALE + BOX_XMIN;
+    frame->positions[i].y =
+        (double) previous[2 * i + 1] / TRAJECTORY_QUANT_SCALE + BOX_YMIN;
+  }
+
+  if (numEvents > frame->eventCapacity) {
+    frame->eventCapacity = 2 * numEvents;
+    frame->events = realloc(frame->events,
+                            frame->eventCapacity * sizeof(CollisionEvent));
+    assert(frame->events != NULL);
+  }
+  for (int i = 0; i < numEvents; i++) {
+    uint32_t id1;
+    uint32_t gap;
+    in = getVarint(in, end, &id1);
+    in = in == NULL ? NULL : getVarint(in, end, &gap);
+    if (in == NULL || in == end) {
+      return false;
+    }
+    frame->events[i].id1 = id1;
+    frame->events[i].id2 = id1 + gap;
+    frame->events[i].intersectionType = (IntersectionType) *in++;
+  }
+  frame->numEvents = numEvents;
+  frame->frame = record[0];
+  return in == end;
+}
+
+bool TrajectoryReader_dump(const char* path, FILE* out) {
+  TrajectoryReader* trajectoryReader = TrajectoryReader_new(path);
+  if (trajectoryReader == NULL) {
+    return false;
+  }
+  const unsigned int numOfLines = trajectoryReader->numOfLines;
+  TrajectoryFrame frame;
+  frame.positions = malloc(2 * numOfLines * sizeof(Vec));
+  frame.eventCapacity = 0;
+  frame.events = NULL;
+  frame.frame = 0;
+
+  fprintf(out, "%u lines%s\n", numOfLines,
+          trajectoryReader->flags & TRAJECTORY_COMPRESSED ?
+              ", compressed" : "");
+  while (TrajectoryReader_next(trajectoryReader, &frame)) {
+    fprintf(out, "frame %u: %u events\n", frame.frame, frame.numEvents);
+    for (int i = 0; i < frame.numEvents; i++) {
+      fprintf(out, "event %u %u %d\n", frame.events[i].id1,
+              frame.events[i].id2, frame.events[i].intersectionType);
+    }
+    for (int i = 0; i < numOfLines; i++) {
+      window_dimension x1, y1, x2, y2;
+      boxToWindow(&x1, &y1, frame.positions[2 * i].x,
+                  frame.positions[2 * i].y);
+      boxToWindow(&x2, &y2, frame.positions[2 * i + 1].x,
+                  frame.positions[2 * i + 1].y);
+      fprintf(out, "line %d (%f, %f), (%f, %f)\n", i, x1, y1, x2, y2);
+    }
+  }
+  bool complete = trajectoryReader->atEnd;
+  if (!complete) {
+    fprintf(stderr, "%s: damaged frame after frame %u\n", path, frame.frame);
+  }
+  free(frame.positions);
+  free(frame.events);
+  TrajectoryReader_delete(trajectoryReader);
+  return complete;
+}
@@ -0,0 +1,144 @@
+/**
+ * TrajectoryWriter.h -- record line positions and collision events per frame
+ *
+ * The simulation thread only copies each frame into a ring of preallocated
+ * buffers; a background thread encodes and writes them.  Positions are
+ * quantized to fixed point and stored as zigzag varint deltas against the
+ * previous frame, with an absolute keyframe every TRAJECTORY_KEYFRAME_INTERVAL
+ * frames.  When built with ZLIB=1 each frame payload can also be deflated.
+ *
+ * Stream layout (all integers little endian):
+ *   header:  magic, version, numOfLines, flags, quantization scale (u32 each)
+ *   frame:   frame, flags, numEvents, rawSize, storedSize (u32 each),
+ *            then storedSize bytes of payload
+ *   payload: for each line ID, varint deltas of p1.x, p1.y, p2.x, p2.y;
+ *            then for each event, varint id1, varint (id2 - id1), type byte
+ *
+ * A payload is deflated only if that makes it smaller, so storedSize is
+ * less than rawSize exactly when it is.  TrajectoryReader decodes streams.
+ **/
+
+#ifndef TRAJECTORYWRITER_H_
+#define TRAJECTORYWRITER_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "CollisionWorld.h"
+#include "Vec.h"
+
+#define TRAJECTORY_MAGIC 0x52545353  // "SSTR"
+#define TRAJECTORY_VERSION 1
+
+// Number of frames that can be queued ahead of the writer thread.
+#define TRAJECTORY_RING_SIZE 8
+
+// Frames between absolute (non-delta) position records.
+#define TRAJECTORY_KEYFRAME_INTERVAL 64
+
+// Fixed point steps per box unit.
+#define TRAJECTORY_QUANT_SCALE (1 << 20)
+
+// Header flags
+#define TRAJECTORY_COMPRESSED 0x1
+
+// Frame flags
+#define TRAJECTORY_KEYFRAME 0x1
+
+// A frame copied out of the simulation, waiting to be written.
+typedef struct TrajectoryFrame {
+  unsigned int frame;
+
+  // Endpoints indexed by line ID: positions[2 * id] and positions[2 * id + 1]
+  Vec* positions;
+
+  CollisionEvent* events;
+  unsigned int numEvents;
+  unsigned int eventCapacity;
+} TrajectoryFrame;
+
+typedef struct TrajectoryWriter {
+  FILE* fout;
+  unsigned int numOfLines;
+  bool compress;
+
+  // Ring of frames; the simulation fills ring[tail], the writer drains
+  // ring[head].  numQueued frames are waiting to be written.
+  TrajectoryFrame ring[TRAJECTORY_RING_SIZE];
+  unsigned int head;
+  unsigned int tail;
+  unsigned int numQueued;
+  bool done;
+
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty;
+  pthread_cond_t notFull;
+
+  // Writer thread state: last quantized positions and encoding buffers.
+  int32_t* previous;
+  uint8_t* payload;
+  size_t payloadCapacity;
+  uint8_t* compressed;
+  size_t compressedCapacity;
+  unsigned int framesWritten;
+
+  // Set when a write fails; no frame is written after it.
+  bool failed;
+} TrajectoryWriter;
+
+// Opens path and starts the writer thread.  Returns NULL if path cannot be
+// opened.  Line IDs must be less than numOfLines.
+TrajectoryWriter* TrajectoryWriter_new(const char* path,
+                                       const unsigned int numOfLines,
+                                       const bool compress);
+
+// Writes out every queued frame, stops the writer thread and closes the file.
+// Returns false, having printed why, if the stream could not be written in
+// full.
+bool TrajectoryWriter_delete(TrajectoryWriter* trajectoryWriter);
+
+// Queues the current positions and the events solved in the last frame.
+// Blocks only if the writer has fallen TRAJECTORY_RING_SIZE frames behind.
+void TrajectoryWriter_record(TrajectoryWriter* trajectoryWriter,
+                             CollisionWorld* collisionWorld,
+                             const unsigned int frame);
+
+// Decodes a stream written by TrajectoryWriter, one frame at a time.
+typedef struct TrajectoryReader {
+  FILE* fin;
+  unsigned int numOfLines;
+  unsigned int flags;
+
+  // True once TrajectoryReader_next has found the end of the stream rather
+  // than a damaged frame
+  bool atEnd;
+
+  // Last decoded positions, quantized, and decoding buffers
+  int32_t* previous;
+  uint8_t* payload;
+  size_t payloadCapacity;
+  uint8_t* stored;
+  size_t storedCapacity;
+} TrajectoryReader;
+
+// Opens path and reads the stream header.  Returns NULL if path cannot be
+// opened or is not a stream this version can read.
+TrajectoryReader* TrajectoryReader_new(const char* path);
+
+void TrajectoryReader_delete(TrajectoryReader* trajectoryReader);
+
+// Decodes the next frame into frame, whose positions hold 2 * numOfLines
+// endpoints; its events grow as needed.  Positions come back to within
+// 1 / TRAJECTORY_QUANT_SCALE of the recorded ones.  Returns false at the
+// end of the stream or on a damaged frame.
+bool TrajectoryReader_next(TrajectoryReader* trajectoryReader,
+                           TrajectoryFrame* frame);
+
+// Prints every frame of the stream at path: its events, and the lines in
+// window coordinates.  Returns false if the stream cannot be read.
+bool TrajectoryReader_dump(const char* path, FILE* out);
+
+#endif  // TRAJECTORYWRITER_H_